@@ -0,0 +1,286 @@
+/*
+ * HeapTossEscapeAnalysis.h
+ *
+ * Decides which stack slots of a function can have their address escape.
+ */
+#ifndef HEAPTOSSESCAPEANALYSIS_H_
+#define HEAPTOSSESCAPEANALYSIS_H_
+#include <vector>
+
+#include "llvm/Function.h"
+#include "llvm/Instructions.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Support/CallSite.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+ * Escape analysis over the stack slots of a single function.
+ *
+ * Every instruction is visited exactly once, in reverse post-order, so the definition of a
+ * pointer is always seen before its uses (PHIs are the exception, and are checked once the
+ * walk is done). Each pointer derived from a slot is mapped to the node of its slot as it is
+ * defined.
+ *
+ * Stores of a slot's address into another slot are followed with a unification-based
+ * points-to analysis: every node has at most one pointee node, which stands for everything
+ * that may be stored into it. Storing a pointer into a slot unifies the pointer's node with
+ * the slot's pointee, and loading a pointer from a slot yields a pointer to the slot's
+ * pointee. So `int * p = &x` does not let x escape on its own; only letting p escape does.
+ *
+ * A node escapes if a pointer to it is passed to a call, stored into memory that is not a
+ * slot, returned, cast, merged in a PHI or used in any other way than loaded from, stored
+ * into or used as the base of a GEP. Once the walk is done, whatever an escaping node holds
+ * escapes as well, along chains of slots, until nothing changes. With trustNoCapture,
+ * passing a pointer as an argument that the callee marks nocapture does not let its node
+ * escape, but still lets what it holds escape.
+ *
+ * The cost is nearly linear in the size of the function, no matter how deep the GEP chains
+ * or how many uses a slot has.
+ */
+class HeapTossEscapeAnalysis {
+private:
+  //Maps every pointer derived from a stack slot (the slot itself, GEPs on it, and pointers
+  //loaded from it) to the node it points to.
+  DenseMap<Value*, unsigned> nodeOf;
+  //The node of each stack slot.
+  DenseMap<AllocaInst*, unsigned> slotNode;
+
+  //Union-find over the nodes. Only the root of a class has a meaningful pointee and flags.
+  std::vector<unsigned> parent;
+  //The node that stands for what may be stored in each node, or -1 if nothing was.
+  std::vector<int> pointee;
+  //The first use found that lets each node escape, or NULL if it does not escape.
+  std::vector<Instruction*> escapedBy;
+  //The first use found that lets what each node holds escape, but not the node itself.
+  std::vector<Instruction*> exposedBy;
+
+  //The first use that lets each escaping slot escape. Slots that are not in here do not
+  //escape.
+  DenseMap<AllocaInst*, Instruction*> escapingUse;
+  //Every stack slot escapes.
+  bool tossAll;
+  //Calls do not capture arguments marked nocapture.
+  bool trustNoCapture;
+
+  unsigned createNode() {
+    parent.push_back(parent.size());
+    pointee.push_back(-1);
+    escapedBy.push_back(NULL);
+    exposedBy.push_back(NULL);
+    return parent.size() - 1;
+  }
+
+  unsigned find(unsigned node) {
+    unsigned root = node;
+    while (parent[root] != root) root = parent[root];
+    while (parent[node] != root) {
+      unsigned next = parent[node];
+      parent[node] = root;
+      node = next;
+    }
+    return root;
+  }
+
+  /**
+   * Returns the node that stands for what may be stored in node.
+   */
+  unsigned getPointee(unsigned node) {
+    unsigned root = find(node);
+    if (pointee[root] < 0) {
+      unsigned created = createNode();
+      pointee[root] = created;
+    }
+    return pointee[root];
+  }
+
+  /**
+   * Merges the classes of a and b, and then the classes of their pointees.
+   */
+  void unify(unsigned a, unsigned b) {
+    a = find(a);
+    b = find(b);
+    if (a == b) return;
+
+    parent[b] = a;
+    if (escapedBy[a] == NULL) escapedBy[a] = escapedBy[b];
+    if (exposedBy[a] == NULL) exposedBy[a] = exposedBy[b];
+    if (pointee[a] < 0) pointee[a] = pointee[b];
+    else if (pointee[b] >= 0) unify(pointee[a], pointee[b]);
+  }
+
+  /**
+   * Records that the given use lets node escape.
+   */
+  void escape(unsigned node, Instruction * use) {
+    unsigned root = find(node);
+    if (escapedBy[root] == NULL) escapedBy[root] = use;
+  }
+
+  /**
+   * Records that the given use lets what node holds escape.
+   */
+  void expose(unsigned node, Instruction * use) {
+    unsigned root = find(node);
+    if (exposedBy[root] == NULL) exposedBy[root] = use;
+  }
+
+  /**
+   * Checks if values of type may hold pointers that we can not follow.
+   */
+  static bool isOpaque(Type * type) {
+    return !type->isSingleValueType() || type->isVectorTy();
+  }
+
+  /**
+   * Classifies the use of a pointer to node as operand opNum of inst.
+   */
+  void visitUse(Instruction * inst, unsigned opNum, unsigned node) {
+    //OK if just loaded. A loaded pointer points to whatever was stored.
+    if (isa<LoadInst>(inst)) {
+      if (inst->getType()->isPointerTy()) {
+        nodeOf[inst] = getPointee(node);
+      }
+      else if (isOpaque(inst->getType())) {
+        expose(node, inst);
+      }
+      return;
+    }
+    //OK if stored into. Storing the address itself is only OK if it goes into a slot.
+    else if (StoreInst * store = dyn_cast<StoreInst>(inst)) {
+      Value * value = store->getValueOperand();
+      DenseMap<Value*, unsigned>::iterator container = nodeOf.find(store->getPointerOperand());
+
+      if (opNum == StoreInst::getPointerOperandIndex()) {
+        //Pointers we do not follow may point anywhere, so neither may what they point to.
+        bool untracked = value->getType()->isPointerTy() && nodeOf.count(value) == 0
+            && !isa<ConstantPointerNull>(value) && !isa<UndefValue>(value);
+        if (untracked || isOpaque(value->getType())) expose(getPointee(node), inst);
+        return;
+      }
+      if (container != nodeOf.end()) {
+        unify(getPointee(container->second), node);
+        return;
+      }
+    }
+    //OK if the element ptr can't escape. We find out when its uses are visited.
+    else if (isa<GetElementPtrInst>(inst)) {
+      if (opNum == 0) {
+        nodeOf[inst] = node;
+        return;
+      }
+    }
+    //OK if the callee promises not to keep it. It may still keep what it points to.
+    else if (trustNoCapture && (isa<CallInst>(inst) || isa<InvokeInst>(inst))) {
+      CallSite cs(inst);
+      if (opNum < cs.arg_size() && cs.paramHasAttr(opNum + 1, Attribute::NoCapture)) {
+        expose(node, inst);
+        return;
+      }
+    }
+
+    //Anything else is bad!
+    escape(node, inst);
+  }
+
+  /**
+   * Lets whatever escaping and exposed nodes hold escape too, until nothing changes.
+   */
+  void propagateEscapes() {
+    std::vector<unsigned> worklist;
+    for (unsigned n = 0; n < parent.size(); n++) {
+      if (find(n) == n && (escapedBy[n] != NULL || exposedBy[n] != NULL)) worklist.push_back(n);
+    }
+
+    while (!worklist.empty()) {
+      unsigned node = worklist.back();
+      worklist.pop_back();
+      if (pointee[node] < 0) continue;
+
+      unsigned held = find(pointee[node]);
+      if (escapedBy[held] != NULL) continue;
+      escapedBy[held] = escapedBy[node] != NULL ? escapedBy[node] : exposedBy[node];
+      worklist.push_back(held);
+    }
+  }
+
+public:
+  HeapTossEscapeAnalysis(bool tossAll, bool trustNoCapture) : tossAll(tossAll), trustNoCapture(trustNoCapture) {}
+
+  /**
+   * Computes the verdicts for every stack slot in f. Discards the verdicts of the
+   * previous function.
+   */
+  void analyze(Function & f) {
+    nodeOf.clear();
+    slotNode.clear();
+    escapingUse.clear();
+    parent.clear();
+    pointee.clear();
+    escapedBy.clear();
+    exposedBy.clear();
+
+    std::vector<PHINode*> phis;
+    ReversePostOrderTraversal<Function*> rpot(&f);
+    for (ReversePostOrderTraversal<Function*>::rpo_iterator b_iter = rpot.begin(); b_iter != rpot.end(); b_iter++) {
+      BasicBlock * b = *b_iter;
+      for (BasicBlock::iterator i = b->begin(); i != b->end(); i++) {
+        Instruction * inst = i;
+
+        if (isa<AllocaInst>(inst)) {
+          unsigned node = createNode();
+          nodeOf[inst] = node;
+          slotNode[dyn_cast<AllocaInst>(inst)] = node;
+        }
+
+        //PHIs can refer to values defined later in the walk.
+        if (isa<PHINode>(inst)) {
+          phis.push_back(dyn_cast<PHINode>(inst));
+          continue;
+        }
+
+        for (unsigned op = 0; op < inst->getNumOperands(); op++) {
+          DenseMap<Value*, unsigned>::iterator node = nodeOf.find(inst->getOperand(op));
+          if (node != nodeOf.end()) visitUse(inst, op, node->second);
+        }
+      }
+    }
+
+    //Merging a slot's address with another pointer is an escape.
+    for (unsigned p = 0; p < phis.size(); p++) {
+      for (unsigned op = 0; op < phis[p]->getNumIncomingValues(); op++) {
+        DenseMap<Value*, unsigned>::iterator node = nodeOf.find(phis[p]->getIncomingValue(op));
+        if (node != nodeOf.end()) escape(node->second, phis[p]);
+      }
+    }
+
+    propagateEscapes();
+
+    for (DenseMap<AllocaInst*, unsigned>::iterator slot = slotNode.begin(); slot != slotNode.end(); slot++) {
+      Instruction * use = escapedBy[find(slot->second)];
+      if (use != NULL) escapingUse[slot->first] = use;
+    }
+  }
+
+  /**
+   * Checks if a stack slot's address can escape.
+   */
+  bool canEscape(AllocaInst * slot) {
+    if (tossAll) return true;
+    return escapingUse.count(slot) != 0;
+  }
+
+  /**
+   * Returns the first use found that lets slot escape, or NULL if it does not escape
+   * (or if every slot escapes because of TOSS_ALL).
+   */
+  Instruction * getEscapingUse(AllocaInst * slot) {
+    DenseMap<AllocaInst*, Instruction*>::iterator use = escapingUse.find(slot);
+    return use == escapingUse.end() ? NULL : use->second;
+  }
+};
+
+#endif /* HEAPTOSSESCAPEANALYSIS_H_ */
@@ -1,14 +1,61 @@
 #include "HeapTossStats.h"
+#include "HeapTossEscapeAnalysis.h"
+#include "HeapTossRemarks.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
 
 // Are we running HeapToss through opt, or through clang? If it's through clang,
 // all configuration must be done statically.
 #define RUN_HT_THROUGH_OPT true
 
+//Alignment of a tossed frame when we can not tell what its slots need. It is what malloc
+//guarantees, so it is what frames always got before the allocation ABI.
+#define DEFAULT_FRAME_ALIGNMENT 16
+//Aggregates with more fields (or elements) than this are never split.
+#define MAX_SPLIT_FIELDS 32
+
+//Cost model of -ht-cost-model, in units of one small allocation and free. Frames up to
+//SMALL_FRAME_SIZE bytes fit the pool backend's size classes; larger ones go to malloc, and
+//cost LARGE_FRAME_COST. Every byte adds a little on top, for the memory the frame takes up.
+//A frame that is allocated lazily costs LAZY_FRAME_COST more, to check it at every return,
+//and LOOP_FRAME_COST more per loop level around the uses of its slots, for keeping one more
+//base pointer live through those loops.
+#define SMALL_FRAME_SIZE 4096
+#define LARGE_FRAME_COST 4.0
+#define LAZY_FRAME_COST 0.05
+#define LOOP_FRAME_COST 0.1
+
 #if RUN_HT_THROUGH_OPT
   cl::opt<bool> TOSS_INDIVIDUALLY   ("ht-toss-individually", cl::init(false), cl::desc("Toss every stack variable individually, as opposed to tossing them all at once."));
   cl::opt<bool> TOSS_ALL ("ht-toss-all", cl::init(false), cl::desc("Do not use a tossing heuristic, and simply toss every stack variable into the heap."));
   cl::opt<bool> TOSS_NONE ("ht-toss-none", cl::init(false), cl::desc("Do not toss any stack variables into the heap. Primarily useful for viewing dynamic statistics on a program without tossing anything, or for viewing the impact of changing the alignment of MemIntrinsics to 1."));
   cl::opt<bool> GATHER_STATS ("ht-gather-stats", cl::init(false), cl::desc("Modify the program to gather statistics at runtime (function run count, etc). You must link the program against libHeapToss for this to work."));
+  cl::opt<bool> CONTEXT_PROFILE ("ht-context-profile", cl::init(false), cl::desc("[MUST BE USED WITH ht-gather-stats!] Keep a thread-local shadow context at every call site, and profile toss counts and bytes per calling context. The runtime writes them in collapsed-stack format for flame graph tools."));
+  cl::opt<bool> VERSION_MEMINTRINSICS ("ht-version-memintrinsics", cl::init(true), cl::desc("Emit an aligned and an unaligned version of every MemIntrinsic that may touch tossed memory, and pick one with a runtime alignment check. If disabled, the alignment of every MemIntrinsic is forced to 1."));
+  cl::opt<bool> COALESCE_FRAMES ("ht-coalesce-frames", cl::init(false), cl::desc("When a function with a constant-size tossed frame directly calls a non-recursive function in the same module that also has one, reserve room for the callee's frame in the caller's frame and pass it to a clone of the callee. Saves one malloc per call level."));
+  cl::opt<bool> ALLOCATOR_ABI ("ht-allocator-abi", cl::init(true), cl::desc("Allocate tossed frames with heaptoss_alloc(size, align) and release them with heaptoss_free(ptr, size, align), so that the runtime can route them to the backend picked by HEAPTOSS_ALLOCATOR. You must link the program against libHeapToss for this to work. If disabled, malloc and free are called directly."));
+  cl::opt<bool> ANNOTATE_FRAMES ("ht-annotate-frames", cl::init(true), cl::desc("[ONLY WITH ht-allocator-abi!] Tell later passes what we know about tossed frames: heaptoss_alloc returns memory that aliases nothing else, heaptoss_free does not capture it, neither throws, and loads and stores of tossed slots get the alignment their place in the frame guarantees."));
+  cl::opt<bool> SHADOW_SLOTS ("ht-shadow-slots", cl::init(false), cl::desc("[NOT WITH ht-toss-individually!] Give every tossed scalar a stack copy that its loads and stores use instead, which mem2reg can keep in a register. The copy is written back to the frame before anything that may read the frame (calls, loads and stores through pointers that may point into it), and reloaded after anything that may write it."));
+  cl::opt<bool> STATIC_FRAMES ("ht-static-frames", cl::init(false), cl::desc("[NOT WITH ht-toss-individually!] Give non-reentrant functions a static frame instead of a heap frame per call. A function is non-reentrant if it is not recursive in the call graph, and is annotated with __attribute__((annotate(\"heaptoss_nonreentrant\"))) or ht-single-threaded is set, its address is not taken, it has local linkage (or ht-whole-program is set) and it never reaches an indirect or external call. Frames are thread-local unless ht-single-threaded is set."));
+  cl::opt<bool> SINGLE_THREADED ("ht-single-threaded", cl::init(false), cl::desc("[ONLY WITH ht-static-frames!] The program only ever runs on one thread. Every non-recursive internal function (every one with ht-whole-program) whose address is not taken, and that never reaches an indirect or external call, gets a static frame, and static frames are plain globals."));
+  cl::opt<bool> CHECK_REENTRANCY ("ht-check-reentrancy", cl::init(false), cl::desc("[ONLY WITH ht-static-frames!] Trap in the runtime if a function with a static frame is entered again while its frame is in use. Only functions that can not unwind are checked. You must link the program against libHeapToss for this to work."));
+  cl::opt<bool> MULTIVERSION ("ht-multiversion", cl::init(false), cl::desc("Keep an untossed copy of every function that tosses, and pick the tossed or untossed body on entry from a per-function flag. The runtime sets the flags from HEAPTOSS_TOSS at startup, and heaptoss_set_tossing changes them later. You must link the program against libHeapToss for this to work."));
+  cl::opt<bool> DEMOTE_MALLOCS ("ht-demote-mallocs", cl::init(false), cl::desc("Turn calls to malloc into stack slots if their size is at most ht-demote-max-size and their result never escapes the function. Their frees are removed."));
+  cl::opt<unsigned> DEMOTE_MAX_SIZE ("ht-demote-max-size", cl::init(256), cl::desc("[ONLY WITH ht-demote-mallocs!] Largest malloc, in bytes, to turn into a stack slot. The size must be a constant, or a select between constants."));
+  cl::opt<bool> COST_MODEL ("ht-cost-model", cl::init(false), cl::desc("[NOT WITH ht-toss-individually!] Choose, for each tossed slot, between the batched frame allocated on entry, an allocation of its own, or a cold group of slots that share a frame, from the slots' sizes and how often the blocks that use them run. Frames of their own and the cold group are allocated lazily, in the block that dominates their uses, if that block is outside of every loop. The choices are written to the compile statistics."));
+  cl::opt<bool> PRESERVE_TAIL_CALLS ("ht-preserve-tail-calls", cl::init(true), cl::desc("Keep tail calls that are followed by a return in tail position, by releasing the tossed frame before the call instead of after it. Calls whose arguments may point into the frame, or that are followed by anything other than the release, are left alone."));
+  cl::opt<bool> SPLIT_AGGREGATES ("ht-split-aggregates", cl::init(false), cl::desc("Split struct stack slots that escape into one slot per field, if they are only accessed through constant field indices whose pointers stay within their field, or copied and set as a whole. Only the fields that escape are then tossed."));
+  cl::opt<bool> WHOLE_PROGRAM ("ht-whole-program", cl::init(false), cl::desc("The module is the whole program (e.g. after llvm-link). Infer which pointer arguments each function never captures, over the whole call graph, and let stack slots passed as such arguments stay on the stack. Always writes the compile statistics."));
+  cl::opt<std::string> REMARKS_FILE ("ht-remarks-file", cl::init(""), cl::desc("Write a YAML remark for every tossed stack slot to the given file: its function, source variable and line, the use that lets it escape and the kind of use, its size, and its function's call count. Remarks are sorted by estimated cost."));
+  cl::opt<std::string> REMARKS_PROFILE ("ht-remarks-profile", cl::init(""), cl::desc("[MUST BE USED WITH ht-remarks-file!] Run statistics file (htstats_run_N.csv) of a program built with ht-gather-stats. Its execution counts are used to estimate the cost of each tossed slot."));
   cl::opt<bool> MALLOC_NO_TOSS ("ht-malloc-no-toss", cl::init(false), cl::desc("(For RM) Call malloc/free to allocate/deallocate memory in the heap for stack variables, but do not actually toss any of the stack variables."));
   cl::opt<unsigned> RANDOM_TOSS ("ht-random-toss", cl::init(0), cl::desc("(For RM) Randomly toss stack variables in a deterministic fashion. Set to 0 to disable. Any other number will be used as the seed to the random number generator used to decide if a variable gets tossed. Note that this does not change the size arguments to malloc."));
   cl::opt<bool> REMOVE_RANDOM_TOSS_FROM_STRUCT ("ht-random-toss-change-malloc-size", cl::init(false), cl::desc("(For RM) [MUST BE USED WITH ht-random-toss!] Same as ht-random-toss, except the size argument to malloc is changed according to the size of the tossed variables. If no variables are tossed, we still call malloc with 0."));
@@ -17,7 +64,25 @@
   const bool TOSS_ALL = false;
   const bool TOSS_NONE = false;
   const bool GATHER_STATS = false;
+  const bool CONTEXT_PROFILE = false;
   const bool MALLOC_NO_TOSS = false;
+  const bool VERSION_MEMINTRINSICS = true;
+  const bool COALESCE_FRAMES = false;
+  const bool ALLOCATOR_ABI = true;
+  const bool ANNOTATE_FRAMES = true;
+  const bool SHADOW_SLOTS = false;
+  const bool STATIC_FRAMES = false;
+  const bool SINGLE_THREADED = false;
+  const bool CHECK_REENTRANCY = false;
+  const bool MULTIVERSION = false;
+  const bool DEMOTE_MALLOCS = false;
+  const bool COST_MODEL = false;
+  const bool PRESERVE_TAIL_CALLS = true;
+  const bool SPLIT_AGGREGATES = false;
+  const bool WHOLE_PROGRAM = false;
+  const unsigned DEMOTE_MAX_SIZE = 256;
+  const std::string REMARKS_FILE = "";
+  const std::string REMARKS_PROFILE = "";
   const unsigned RANDOM_TOSS = 0;
   const bool REMOVE_RANDOM_TOSS_FROM_STRUCT = false;
 #endif
@@ -48,8 +113,61 @@ struct HeapTossPass: public ModulePass {
   //Contains all of the instructions that terminate the current function call.
   set<Instruction *> terminatorInsts;
 
+  //MemIntrinsics in the current function. Their alignment is fixed up once we know which
+  //variables were tossed.
+  std::vector<MemIntrinsic *> memIntrinsics;
+
+  //A tossed frame that was allocated as a single constant-size struct.
+  struct TossedFrame {
+    StructType * type;
+    //The instruction that produces the pointer to the frame.
+    Instruction * frame;
+    //The calls that free it.
+    std::vector<Instruction *> frees;
+  };
+
+  //Constant-size frames of the functions tossed so far. Only filled in with COALESCE_FRAMES.
+  map<Function *, TossedFrame> tossedFrames;
+  //Functions that are part of a cycle in the call graph.
+  set<Function *> recursiveFunctions;
+  //Functions that may reach an indirect call or a call to code outside the module, which may
+  //call them back.
+  set<Function *> reachUnknownCode;
+  //Clones of callees that take their frame from the caller, by original callee.
+  map<Function *, Function *> coalescedClones;
+  //Functions annotated with heaptoss_nonreentrant.
+  set<Function *> nonReentrantFunctions;
+
+  //Copy of the current function from before the pass changed it. Only with MULTIVERSION.
+  Function * originalVersion;
+  //The same copy, once the current function turns out to toss something.
+  Function * untossedVersion;
+  //Functions that pick their version on entry, and their toss flags.
+  std::vector<Function *> versionedFunctions;
+  std::vector<GlobalVariable *> tossFlags;
+
   HeapTossStats * stats;
 
+  //The allocation ABI of the runtime. Only set with ALLOCATOR_ABI.
+  Function * heaptossAlloc;
+  Function * heaptossFree;
+  //Calls that release tossed frames in the current function.
+  set<Instruction *> frameReleases;
+  //Underlying objects of the frames the current function tossed: the calls that allocate
+  //them, and the buffers of static frames.
+  set<Value *> tossedFrameObjects;
+  //Only set with CHECK_REENTRANCY.
+  Function * heaptossFrameEnter;
+
+  //May be NULL if the module does not describe its target.
+  TargetData * targetData;
+
+  //Escape verdicts for the stack slots of the current function.
+  HeapTossEscapeAnalysis * escapeAnalysis;
+
+  //Why each tossed slot was tossed. Only written with REMARKS_FILE.
+  HeapTossRemarks * remarks;
+
   //Used for handy debugging.
   Function * currentFunction;
 
@@ -57,23 +175,30 @@ struct HeapTossPass: public ModulePass {
 
   }
 
+  void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<CallGraph>();
+    if (COST_MODEL) {
+      AU.addRequired<BlockFrequencyInfo>();
+      AU.addRequired<DominatorTree>();
+      AU.addRequired<LoopInfo>();
+    }
+  }
+
   /**
    * Removes variables that do not escape from the input set.
    */
   void filterUnescapingVariables(set<AllocaInst*> & allocas) {
-    set<AllocaInst *> filteredAllocas;
-    for (set<AllocaInst *>::iterator a_iter = allocas.begin(); a_iter != allocas.end(); a_iter++)
+    for (set<AllocaInst *>::iterator a_iter = allocas.begin(); a_iter != allocas.end();)
     {
-      AllocaInst * aInst = dyn_cast<AllocaInst>(*a_iter);
+      AllocaInst * aInst = *a_iter;
 
-      if (canEscape(aInst)) {
-        filteredAllocas.insert(aInst);
+      if (!escapeAnalysis->canEscape(aInst)) {
+        allocas.erase(a_iter++);
+      }
+      else {
+        a_iter++;
       }
     }
-
-    //Replace the input set with the filtered set.
-    allocas.clear();
-    allocas.swap(filteredAllocas);
   }
     
   /**
@@ -121,11 +246,69 @@ struct HeapTossPass: public ModulePass {
   }
 
   /**
-   * Inserts a call to malloc before insertBefore with the given size argument.
-   * Also calls free before all of the reachable terminators.
+   * Casts an integer to ptrType, inserting the cast before insertBefore if it is not a constant.
+   */
+  Value * castToPtrType(Value * value, Instruction * insertBefore) {
+    if (value->getType() == ptrType) return value;
+    if (isa<Constant>(value)) return ConstantExpr::getIntegerCast(dyn_cast<Constant>(value), ptrType, false);
+    return CastInst::CreateIntegerCast(value, ptrType, false, "", insertBefore);
+  }
+
+  /**
+   * Returns the alignment the given stack slot needs.
+   */
+  unsigned getAlignment(AllocaInst * alloca) {
+    unsigned alignment = alloca->getAlignment();
+    if (alignment == 0) {
+      if (targetData == NULL) return DEFAULT_FRAME_ALIGNMENT;
+      alignment = targetData->getABITypeAlignment(alloca->getAllocatedType());
+    }
+    return alignment;
+  }
+
+  /**
+   * Inserts a call to free (or heaptoss_free) on memory before insertBefore. sizeArg and
+   * alignmentArg are only used with ALLOCATOR_ABI.
+   */
+  Instruction * callFree(Value * memory, Value * sizeArg, Value * alignmentArg, Instruction * insertBefore) {
+    Instruction * freeCall;
+    if (!ALLOCATOR_ABI) {
+      freeCall = CallInst::CreateFree(memory, insertBefore);
+    }
+    else {
+      Type * i8PtrType = Type::getInt8PtrTy(memory->getContext());
+      if (memory->getType() != i8PtrType) memory = new BitCastInst(memory, i8PtrType, "", insertBefore);
+      Value * freeArgs[] = { memory, sizeArg, alignmentArg };
+      freeCall = CallInst::Create(heaptossFree, freeArgs, "", insertBefore);
+    }
+    frameReleases.insert(freeCall);
+    return freeCall;
+  }
+
+  /**
+   * Inserts a call to malloc (or heaptoss_alloc) before insertBefore with the given size
+   * argument. Also calls free (or heaptoss_free) before all of the reachable terminators. If
+   * frees is not NULL, the calls to free are added to it.
+   *
+   * Returns a pointer to type.
    */
-  Instruction * callMalloc(Instruction* insertBefore, Type * type, Value * size, set<Instruction *> & terminators) {
-    Instruction * call = CallInst::CreateMalloc(insertBefore, ptrType, type, size);
+  Instruction * callMalloc(Instruction* insertBefore, Type * type, Value * size, unsigned alignment,
+      set<Instruction *> & terminators, std::vector<Instruction *> * frees = NULL) {
+    Instruction * call;
+    Value * sizeArg = NULL;
+    Value * alignmentArg = NULL;
+
+    if (ALLOCATOR_ABI) {
+      sizeArg = castToPtrType(size, insertBefore);
+      alignmentArg = ConstantInt::get(ptrType, alignment, false);
+      Value * allocArgs[] = { sizeArg, alignmentArg };
+      Instruction * memory = CallInst::Create(heaptossAlloc, allocArgs, "", insertBefore);
+      call = new BitCastInst(memory, PointerType::getUnqual(type), "", insertBefore);
+    }
+    else {
+      call = CallInst::CreateMalloc(insertBefore, ptrType, type, size);
+    }
+    tossedFrameObjects.insert(GetUnderlyingObject(call));
 
     BasicBlock * parentBlock = insertBefore->getParent();
     Function * parentFunction = parentBlock->getParent();
@@ -137,7 +320,8 @@ struct HeapTossPass: public ModulePass {
       Instruction * terminator = dyn_cast<Instruction>(*i);
       //Note: isReachable does not work.
       if (isFirstBlock || isReachable(parentBlock, terminator->getParent())) {
-        CallInst::CreateFree(call, terminator);
+        Instruction * freeCall = callFree(call, sizeArg, alignmentArg, terminator);
+        if (frees != NULL) frees->push_back(freeCall);
         stats->addTerminator(currentFunction, terminator);
       }
     }
@@ -166,6 +350,21 @@ struct HeapTossPass: public ModulePass {
     return BinaryOperator::Create(BinaryOperator::Mul, elementSize, arraySize, "", alloca);
   }
 
+  /**
+   * Sets the alignment of the loads and stores that go straight through field, a pointer to a
+   * slot in a tossed frame, to the alignment its place in the frame guarantees.
+   */
+  void setFieldAlignment(Instruction * field, unsigned alignment) {
+    for (Value::use_iterator u = field->use_begin(); u != field->use_end(); u++) {
+      if (LoadInst * load = dyn_cast<LoadInst>(*u)) {
+        load->setAlignment(alignment);
+      }
+      else if (StoreInst * store = dyn_cast<StoreInst>(*u)) {
+        if (store->getPointerOperand() == field) store->setAlignment(alignment);
+      }
+    }
+  }
+
   /**
    * Tosses all of the variables in toToss with individual malloc/free calls.
    */
@@ -177,13 +376,13 @@ struct HeapTossPass: public ModulePass {
     {
       AllocaInst * aInst = dyn_cast<AllocaInst>(*a_iter);
       Value * size = getSize(aInst);
-      Instruction * call = callMalloc(aInst, aInst->getAllocatedType(), size, terminators);
+      Instruction * call = callMalloc(aInst, aInst->getAllocatedType(), size, getAlignment(aInst), terminators);
       //TODO: Is this still needed now that I use CreateMalloc?
       BitCastInst * bitcast = new BitCastInst(call, aInst->getType(), "", aInst);
 
       //Stat collection for dynamic allocas.
       if (!aInst->isStaticAlloca()) {
-        stats->addDynamicToss(aInst->getParent()->getParent(), size, bitcast);
+        stats->addDynamicToss(aInst->getParent()->getParent(), size, bitcast, terminators);
       }
       replaceAlloca(aInst, bitcast);
     }
@@ -217,6 +416,8 @@ struct HeapTossPass: public ModulePass {
     //Contains the type for each element in the struct.
     //TODO: Would it make any difference how these are ordered?
     std::vector<Type *> structElements;
+    //The frame needs the strictest alignment of its slots.
+    unsigned alignment = 1;
     for (set<AllocaInst *>::iterator a_iter = allocas.begin(); a_iter != allocas.end(); a_iter++)
     {
       //shouldToss is only initialized if RANDOM_TOSS is set, which should be the case if
@@ -226,6 +427,7 @@ struct HeapTossPass: public ModulePass {
 
         if (aInst->isStaticAlloca()) {
           structElements.push_back(aInst->getAllocatedType());
+          if (getAlignment(aInst) > alignment) alignment = getAlignment(aInst);
         }
         else {
           errs() << "ERROR: TRYING TO TOSS NON STATIC ALLOCA IN A STRUCT\n";
@@ -237,7 +439,20 @@ struct HeapTossPass: public ModulePass {
       rindex++;
     }
 
+    //Room for the frames of the callees we coalesce, after the variables.
+    map<Function *, unsigned> calleeFields;
+    std::vector<Instruction *> coalescedCalls = findCoalescibleCalls();
+    for (unsigned c = 0; c < coalescedCalls.size(); c++) {
+      Function * callee = CallSite(coalescedCalls[c]).getCalledFunction();
+      if (calleeFields.count(callee) == 0) {
+        calleeFields[callee] = structElements.size();
+        structElements.push_back(tossedFrames[callee].type);
+      }
+    }
+
     Instruction * mallocCall;
+    std::vector<Instruction *> frees;
+    bool staticFrame = hasStaticFrame(currentFunction);
     Type * structType;
     Constant * structSize;
 
@@ -246,21 +461,35 @@ struct HeapTossPass: public ModulePass {
       structType = StructType::create(structElements, "locals", true);
       structSize = ConstantExpr::getSizeOf(structType);
 
-      stats->setSize(firstInst->getParent()->getParent(), structSize);
+      if (staticFrame) {
+        mallocCall = useStaticFrame(firstInst, structType, alignment, terminators);
+      }
+      else {
+        stats->setSize(firstInst->getParent()->getParent(), structSize);
 
-      //Insert the malloc and free calls.
-      mallocCall = callMalloc(firstInst, structType, structSize, terminators);
+        //Insert the malloc and free calls.
+        mallocCall = callMalloc(firstInst, structType, structSize, alignment, terminators, &frees);
+      }
     }
     //If RANDOM_TOSS causes no stack slots to be tossed, then we call malloc with 0.
     else {
       structSize = ConstantInt::get(Type::getInt64Ty(firstInst->getContext()), 0, false);
       stats->setSize(firstInst->getParent()->getParent(), structSize);
-      mallocCall = callMalloc(firstInst, Type::getInt8PtrTy(firstInst->getContext()), structSize, terminators);
+      mallocCall = callMalloc(firstInst, Type::getInt8PtrTy(firstInst->getContext()), structSize, alignment, terminators);
     }
 
 
+    //Frames are packed, so a slot is only as aligned as its offset in the frame lets it be.
+    //A frame that may end up inside its caller's frame is only known to be byte-aligned.
+    const StructLayout * layout = NULL;
+    bool mayBeCoalesced = COALESCE_FRAMES && recursiveFunctions.count(currentFunction) == 0 && !staticFrame;
+    if (ANNOTATE_FRAMES && (ALLOCATOR_ABI || staticFrame) && targetData != NULL && RANDOM_TOSS == 0 && !mayBeCoalesced) {
+      layout = targetData->getStructLayout(dyn_cast<StructType>(structType));
+    }
+
     if (!MALLOC_NO_TOSS) {
       //Replace all of the variables with getElementPtrs.
+      std::vector<Instruction *> fields;
       unsigned int index = 0;
       //Used by REMOVE_RANDOM_TOSS_FROM_STRUCT
       unsigned int index2 = 0;
@@ -283,6 +512,10 @@ struct HeapTossPass: public ModulePass {
           GetElementPtrInst * elementPtrInst = GetElementPtrInst::Create(mallocCall, indices, "", aInst);
 
           replaceAlloca(aInst, elementPtrInst);
+          if (layout != NULL) {
+            setFieldAlignment(elementPtrInst, MinAlign(alignment, layout->getElementOffset(index)));
+          }
+          if (SHADOW_SLOTS) fields.push_back(elementPtrInst);
 
           index++;
           index2++;
@@ -293,9 +526,377 @@ struct HeapTossPass: public ModulePass {
           }
         }
       }
+
+      //Hand each coalesced callee its part of our frame, right after we allocate it.
+      map<Function *, Value *> calleeFrames;
+      BasicBlock::iterator afterMalloc = mallocCall;
+      afterMalloc++;
+      for (map<Function *, unsigned>::iterator c = calleeFields.begin(); c != calleeFields.end(); c++) {
+        LLVMContext & ctx = mallocCall->getContext();
+        Value * indices[] = { ConstantInt::get(Type::getInt32Ty(ctx), 0, false), ConstantInt::get(Type::getInt32Ty(ctx), c->second, false) };
+        Value * field = GetElementPtrInst::Create(mallocCall, indices, "ht.callee.frame", afterMalloc);
+        calleeFrames[c->first] = new BitCastInst(field, Type::getInt8PtrTy(ctx), "", afterMalloc);
+      }
+      for (unsigned c = 0; c < coalescedCalls.size(); c++) {
+        Function * callee = CallSite(coalescedCalls[c]).getCalledFunction();
+        callCoalescedClone(coalescedCalls[c], getCoalescedClone(callee), calleeFrames[callee]);
+        stats->addCoalescedCall(currentFunction);
+      }
+
+      if (SHADOW_SLOTS) shadowFields(mallocCall, fields);
+
+      //Static frames can not be coalesced. Their callers run them with the static frame.
+      if (COALESCE_FRAMES && RANDOM_TOSS == 0 && !staticFrame) {
+        TossedFrame & tossedFrame = tossedFrames[currentFunction];
+        tossedFrame.type = dyn_cast<StructType>(structType);
+        tossedFrame.frame = mallocCall;
+        tossedFrame.frees = frees;
+      }
+    }
+  }
+
+  //A tossed scalar, and the stack copy that its loads and stores use.
+  struct ShadowedField {
+    Instruction * field;
+    AllocaInst * shadow;
+    //Alignment of the accesses to the field.
+    unsigned alignment;
+  };
+
+  //What a sync point may do to a tossed frame.
+  enum FrameAccess {
+    FRAME_NO_ACCESS,
+    FRAME_READ,
+    FRAME_WRITE
+  };
+
+  /**
+   * Returns what inst may do to a tossed frame, as far as shadowed fields are concerned.
+   */
+  FrameAccess getFrameAccess(Instruction * inst) {
+    if (LoadInst * load = dyn_cast<LoadInst>(inst)) {
+      return mayPointIntoTossedFrame(load->getPointerOperand()) ? FRAME_READ : FRAME_NO_ACCESS;
+    }
+    if (StoreInst * store = dyn_cast<StoreInst>(inst)) {
+      return mayPointIntoTossedFrame(store->getPointerOperand()) ? FRAME_WRITE : FRAME_NO_ACCESS;
+    }
+    if (isa<CallInst>(inst) || isa<InvokeInst>(inst)) {
+      if (isa<DbgInfoIntrinsic>(inst)) return FRAME_NO_ACCESS;
+
+      CallSite cs(inst);
+      //The runtime never looks at the program's memory, and the frame is released on
+      //every path out of the function anyway.
+      Function * callee = cs.getCalledFunction();
+      if (callee != NULL && (callee->getName().startswith("heaptoss_")
+          || callee->getName() == "malloc" || callee->getName() == "free")) {
+        return FRAME_NO_ACCESS;
+      }
+      if (cs.doesNotAccessMemory()) return FRAME_NO_ACCESS;
+      if (cs.onlyReadsMemory()) return FRAME_READ;
+      return FRAME_WRITE;
+    }
+    if (inst->mayWriteToMemory()) return FRAME_WRITE;
+    if (inst->mayReadFromMemory()) return FRAME_READ;
+    return FRAME_NO_ACCESS;
+  }
+
+  /**
+   * Copies every shadow into its field before insertBefore.
+   */
+  void writeBackShadows(std::vector<ShadowedField> & shadows, Instruction * insertBefore) {
+    for (unsigned s = 0; s < shadows.size(); s++) {
+      Value * value = new LoadInst(shadows[s].shadow, "", false, shadows[s].shadow->getAlignment(), insertBefore);
+      new StoreInst(value, shadows[s].field, false, shadows[s].alignment, insertBefore);
+    }
+  }
+
+  /**
+   * Copies every field into its shadow before insertBefore.
+   */
+  void reloadShadows(std::vector<ShadowedField> & shadows, Instruction * insertBefore) {
+    for (unsigned s = 0; s < shadows.size(); s++) {
+      Value * value = new LoadInst(shadows[s].field, "", false, shadows[s].alignment, insertBefore);
+      new StoreInst(value, shadows[s].shadow, false, shadows[s].shadow->getAlignment(), insertBefore);
+    }
+  }
+
+  /**
+   * Gives each scalar field of a tossed frame a stack copy (a shadow), and points the
+   * field's plain loads and stores at it. Since nothing else uses the shadow, mem2reg can
+   * keep it in a register.
+   *
+   * The frame stays the real home of the variable wherever it can be observed. Before every
+   * instruction that may read the frame, the shadows are written back to it, and after every
+   * instruction that may write it, they are reloaded from it. Frames are freed on every path
+   * out of the function, so returns need neither.
+   */
+  void shadowFields(Instruction * frame, std::vector<Instruction *> & fields) {
+    Function * f = frame->getParent()->getParent();
+    Instruction * entryStart = f->getEntryBlock().begin();
+    std::vector<ShadowedField> shadows;
+
+    for (unsigned i = 0; i < fields.size(); i++) {
+      Instruction * field = fields[i];
+      Type * type = cast<PointerType>(field->getType())->getElementType();
+      if (!type->isSingleValueType()) continue;
+
+      //Plain loads of the field, and plain stores into it.
+      std::vector<Instruction *> accesses;
+      for (Value::use_iterator u = field->use_begin(); u != field->use_end(); u++) {
+        if (LoadInst * load = dyn_cast<LoadInst>(*u)) {
+          if (load->isSimple()) accesses.push_back(load);
+        }
+        else if (StoreInst * store = dyn_cast<StoreInst>(*u)) {
+          if (store->isSimple() && store->getPointerOperand() == field) accesses.push_back(store);
+        }
+      }
+      if (accesses.empty()) continue;
+
+      ShadowedField shadowed;
+      shadowed.field = field;
+      shadowed.shadow = new AllocaInst(type, field->getName() + ".shadow", entryStart);
+      shadowed.alignment = isa<LoadInst>(accesses[0]) ? dyn_cast<LoadInst>(accesses[0])->getAlignment()
+          : dyn_cast<StoreInst>(accesses[0])->getAlignment();
+      shadowed.shadow->setAlignment(shadowed.alignment);
+
+      for (unsigned a = 0; a < accesses.size(); a++) {
+        if (isa<LoadInst>(accesses[a])) {
+          accesses[a]->setOperand(LoadInst::getPointerOperandIndex(), shadowed.shadow);
+        }
+        else {
+          accesses[a]->setOperand(StoreInst::getPointerOperandIndex(), shadowed.shadow);
+        }
+      }
+
+      //Keep the field available everywhere after the frame is allocated.
+      field->moveBefore(frame->getNextNode());
+      shadows.push_back(shadowed);
+    }
+    if (shadows.empty()) return;
+
+    //The sync points. Anything in the entry block before the frame exists is skipped.
+    std::vector<Instruction *> syncPoints;
+    bool frameExists = false;
+    for (Function::iterator b = f->begin(); b != f->end(); b++) {
+      for (BasicBlock::iterator i = b->begin(); i != b->end(); i++) {
+        if (!frameExists) {
+          frameExists = i == BasicBlock::iterator(frame);
+          continue;
+        }
+        if (getFrameAccess(i) != FRAME_NO_ACCESS) syncPoints.push_back(i);
+      }
+      frameExists = true;
+    }
+
+    //Landing pads we already reload in.
+    set<BasicBlock *> reloadedPads;
+    for (unsigned p = 0; p < syncPoints.size(); p++) {
+      Instruction * syncPoint = syncPoints[p];
+      writeBackShadows(shadows, syncPoint);
+      if (getFrameAccess(syncPoint) != FRAME_WRITE) continue;
+
+      if (InvokeInst * invoke = dyn_cast<InvokeInst>(syncPoint)) {
+        //Reload on the normal edge only, so that other paths into the normal destination do
+        //not pick up a stale frame.
+        BasicBlock * normalDest = invoke->getNormalDest();
+        if (normalDest->getSinglePredecessor() == NULL) {
+          normalDest = SplitCriticalEdge(invoke, 0);
+        }
+        reloadShadows(shadows, normalDest->getFirstNonPHI());
+
+        //Only invokes lead to a landing pad, and they all wrote the shadows back.
+        BasicBlock * unwindDest = invoke->getUnwindDest();
+        if (reloadedPads.insert(unwindDest).second) {
+          reloadShadows(shadows, unwindDest->getFirstNonPHI()->getNextNode());
+        }
+      }
+      else {
+        reloadShadows(shadows, syncPoint->getNextNode());
+      }
+    }
+  }
+
+  /**
+   * Checks if f can keep its tossed frame in a static buffer. It must not be recursive in the
+   * call graph, and must never be entered again while it runs: either the user says so with
+   * the heaptoss_nonreentrant annotation, or the program is single-threaded and nothing can
+   * call f behind the call graph's back: its address is not taken, other modules can not
+   * call it (unless this is the whole program), and it never reaches code that could call
+   * it back (e.g. qsort calling a comparator that calls f).
+   */
+  bool hasStaticFrame(Function * f) {
+    if (!STATIC_FRAMES || RANDOM_TOSS > 0 || MALLOC_NO_TOSS) return false;
+    if (recursiveFunctions.count(f) != 0) return false;
+    if (nonReentrantFunctions.count(f) != 0) return true;
+    if (!SINGLE_THREADED || f->hasAddressTaken()) return false;
+    if (!f->hasLocalLinkage() && !WHOLE_PROGRAM) return false;
+    return reachUnknownCode.count(f) == 0;
+  }
+
+  /**
+   * Checks if any function in scc calls through a pointer, calls a function that is only
+   * declared in this module (other than intrinsics), or calls a function that does either.
+   * Callees must have been checked before.
+   */
+  bool reachesUnknownCode(CallGraph & callGraph, const std::vector<Function *> & scc) {
+    for (unsigned i = 0; i < scc.size(); i++) {
+      CallGraphNode * node = callGraph[scc[i]];
+      for (CallGraphNode::iterator call = node->begin(); call != node->end(); call++) {
+        Function * callee = call->second->getFunction();
+        if (callee == NULL || reachUnknownCode.count(callee) != 0) return true;
+        if (callee->isDeclaration() && !callee->isIntrinsic()) return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Returns a pointer to a static frame of the given type for the current function,
+   * inserted before insertBefore. The frame is thread-local unless the program is
+   * single-threaded.
+   *
+   * With CHECK_REENTRANCY, the function also marks its frame as busy on entry and as free
+   * before every terminator. The runtime traps if it is entered while the frame is busy.
+   * A function that unwinds would leave its frame busy, so only nounwind functions are
+   * checked.
+   */
+  Instruction * useStaticFrame(Instruction * insertBefore, Type * type, unsigned alignment, set<Instruction *> & terminators) {
+    Module * M = currentFunction->getParent();
+    LLVMContext & ctx = M->getContext();
+
+    GlobalVariable * buffer = new GlobalVariable(*M, type, false, GlobalValue::InternalLinkage,
+        Constant::getNullValue(type), currentFunction->getName() + ".htstatic", NULL, !SINGLE_THREADED);
+    buffer->setAlignment(alignment);
+    tossedFrameObjects.insert(buffer);
+
+    if (CHECK_REENTRANCY && currentFunction->doesNotThrow()) {
+      Type * i8Type = Type::getInt8Ty(ctx);
+      GlobalVariable * busy = new GlobalVariable(*M, i8Type, false, GlobalValue::InternalLinkage,
+          ConstantInt::get(i8Type, 0, false), currentFunction->getName() + ".htbusy", NULL, !SINGLE_THREADED);
+      Value * enterArgs[] = { busy, stats->getStringPtr(*M, currentFunction->getName(), "ht.fcn.name") };
+      CallInst::Create(heaptossFrameEnter, enterArgs, "", insertBefore);
+
+      for (set<Instruction *>::iterator t = terminators.begin(); t != terminators.end(); t++) {
+        new StoreInst(ConstantInt::get(i8Type, 0, false), busy, *t);
+      }
+    }
+
+    //An instruction, so that the frame can be treated like a malloc'd one.
+    return new BitCastInst(buffer, buffer->getType(), "ht.static.frame", insertBefore);
+  }
+
+  /**
+   * Returns the direct calls in the current function whose callee can use part of the
+   * current function's frame for its own.
+   *
+   * The callee must have a constant-size tossed frame, and must not be recursive. If it is
+   * not recursive, at most one call of it can be active per frame of its caller.
+   */
+  std::vector<Instruction *> findCoalescibleCalls() {
+    std::vector<Instruction *> calls;
+    if (!COALESCE_FRAMES || RANDOM_TOSS > 0 || MALLOC_NO_TOSS) return calls;
+
+    for (Function::iterator b = currentFunction->begin(); b != currentFunction->end(); b++) {
+      for (BasicBlock::iterator i = b->begin(); i != b->end(); i++) {
+        if (!isa<CallInst>(i) && !isa<InvokeInst>(i)) continue;
+
+        CallSite cs(i);
+        Function * callee = cs.getCalledFunction();
+        if (callee == NULL || callee == currentFunction || callee->isVarArg()) continue;
+        if (tossedFrames.count(callee) == 0 || recursiveFunctions.count(callee) != 0) continue;
+        //Calls that never return are where we free our frame.
+        if (terminatorInsts.count(i) != 0) continue;
+
+        calls.push_back(i);
+      }
+    }
+
+    return calls;
+  }
+
+  /**
+   * Returns a clone of callee that takes its frame as an extra i8* argument, instead of
+   * allocating and freeing it.
+   */
+  Function * getCoalescedClone(Function * callee) {
+    if (coalescedClones.count(callee) != 0) return coalescedClones[callee];
+
+    LLVMContext & ctx = callee->getContext();
+    FunctionType * calleeType = callee->getFunctionType();
+    std::vector<Type *> params(calleeType->param_begin(), calleeType->param_end());
+    params.push_back(Type::getInt8PtrTy(ctx));
+    FunctionType * cloneType = FunctionType::get(calleeType->getReturnType(), params, false);
+    Function * clone = Function::Create(cloneType, GlobalValue::InternalLinkage, callee->getName() + ".htframe", callee->getParent());
+
+    ValueToValueMapTy vmap;
+    Function::arg_iterator cloneArg = clone->arg_begin();
+    for (Function::arg_iterator arg = callee->arg_begin(); arg != callee->arg_end(); arg++, cloneArg++) {
+      cloneArg->setName(arg->getName());
+      vmap[arg] = cloneArg;
+    }
+    Argument * frameArg = cloneArg;
+    frameArg->setName("ht.frame");
+
+    SmallVector<ReturnInst *, 8> returns;
+    CloneFunctionInto(clone, callee, vmap, false, returns);
+    clone->setLinkage(GlobalValue::InternalLinkage);
+    clone->setVisibility(GlobalValue::DefaultVisibility);
+
+    //Drop the clone's own allocation.
+    TossedFrame & tossedFrame = tossedFrames[callee];
+    for (unsigned f = 0; f < tossedFrame.frees.size(); f++) {
+      Value * clonedFree = vmap[tossedFrame.frees[f]];
+      eraseDeadChain(cast<Instruction>(clonedFree));
+    }
+    Value * clonedFrame = vmap[tossedFrame.frame];
+    Instruction * frame = cast<Instruction>(clonedFrame);
+    frame->replaceAllUsesWith(new BitCastInst(frameArg, frame->getType(), "", frame));
+    eraseDeadChain(frame);
+
+    coalescedClones[callee] = clone;
+    return clone;
+  }
+
+  /**
+   * Erases inst, and then its first operand as long as nothing else uses it. Used to remove
+   * a malloc or free call along with the casts feeding it.
+   */
+  void eraseDeadChain(Instruction * inst) {
+    while (inst != NULL && inst->use_empty()) {
+      Instruction * operand = inst->getNumOperands() > 0 ? dyn_cast<Instruction>(inst->getOperand(0)) : NULL;
+      inst->eraseFromParent();
+      inst = operand;
     }
   }
 
+  /**
+   * Replaces the given call or invoke with one to clone, which gets frame as its last argument.
+   */
+  void callCoalescedClone(Instruction * call, Function * clone, Value * frame) {
+    CallSite cs(call);
+    std::vector<Value *> args(cs.arg_begin(), cs.arg_end());
+    args.push_back(frame);
+
+    Instruction * newCall;
+    if (isa<InvokeInst>(call)) {
+      InvokeInst * invoke = dyn_cast<InvokeInst>(call);
+      newCall = InvokeInst::Create(clone, invoke->getNormalDest(), invoke->getUnwindDest(), args, "", call);
+    }
+    else {
+      CallInst * newCallInst = CallInst::Create(clone, args, "", call);
+      newCallInst->setTailCall(dyn_cast<CallInst>(call)->isTailCall());
+      newCall = newCallInst;
+    }
+
+    CallSite newCs(newCall);
+    newCs.setCallingConv(cs.getCallingConv());
+    newCs.setAttributes(cs.getAttributes());
+    newCall->setDebugLoc(call->getDebugLoc());
+    newCall->takeName(call);
+    call->replaceAllUsesWith(newCall);
+    call->eraseFromParent();
+  }
+
   /**
    * Tosses all of the variables in toToss.
    * Also responsible for updating global tossing statistics.
@@ -325,9 +926,21 @@ struct HeapTossPass: public ModulePass {
         exit(1);
       }
 
+      untossedVersion = originalVersion;
+
+      //The slots are gone once they are tossed.
+      if (!MALLOC_NO_TOSS && RANDOM_TOSS == 0) {
+        for (set<AllocaInst *>::iterator a_iter = toTossStatic.begin(); a_iter != toTossStatic.end(); a_iter++) {
+          remarks->addTossedSlot(*a_iter, escapeAnalysis->getEscapingUse(*a_iter));
+        }
+      }
+
       if (TOSS_INDIVIDUALLY) {
         tossIndividually(toTossStatic, terminatorInsts);
       }
+      else if (COST_MODEL && RANDOM_TOSS == 0 && !MALLOC_NO_TOSS && targetData != NULL && !hasStaticFrame(currentFunction)) {
+        tossByCostModel(toTossStatic);
+      }
       else {
         tossTogetherElement(toTossStatic, terminatorInsts);
       }
@@ -342,67 +955,379 @@ struct HeapTossPass: public ModulePass {
   }
 
   /**
-   * Checks if a value's address can escape.
+   * Checks if block can run more than once per call of its function.
    */
-  bool canEscape(Value * stackSlot)
-  {
-    if (TOSS_ALL) return true;
+  bool isInCycle(BasicBlock * block) {
+    std::vector<BasicBlock *> worklist;
+    set<BasicBlock *> visited;
+    worklist.push_back(block);
+    while (!worklist.empty()) {
+      TerminatorInst * terminator = worklist.back()->getTerminator();
+      worklist.pop_back();
+      for (unsigned s = 0; s < terminator->getNumSuccessors(); s++) {
+        BasicBlock * successor = terminator->getSuccessor(s);
+        if (successor == block) return true;
+        if (visited.insert(successor).second) worklist.push_back(successor);
+      }
+    }
+    return false;
+  }
 
-    //If the variable is only loaded/stored to, then it doesn't need to be tossed.
-    //Iterate through its uses.
-    for (Value::use_iterator uIter = stackSlot->use_begin(); uIter != stackSlot->use_end(); uIter++)
-    {
-      //Don't want its address leaking.
-      Value * useVal = *uIter;
-      //OK if just loaded.
-      if (isa<LoadInst>(useVal))
-      {
-        LoadInst * load = dyn_cast<LoadInst>(useVal);
-        //Are we loading FROM this stack slot?
-        Value * val = load->getOperand(0);
+  /**
+   * Returns the block that dominates every use of slot. A PHI uses its value at the end of
+   * the incoming block.
+   */
+  BasicBlock * getUseDominator(AllocaInst * slot, DominatorTree & dominators) {
+    BasicBlock * dominator = NULL;
+    for (Value::use_iterator u = slot->use_begin(); u != slot->use_end(); u++) {
+      Instruction * use = cast<Instruction>(*u);
+      BasicBlock * useBlock = use->getParent();
+      if (PHINode * phi = dyn_cast<PHINode>(use)) useBlock = phi->getIncomingBlock(u);
+      //Uses in unreachable code do not matter.
+      if (dominators.getNode(useBlock) == NULL) continue;
+
+      dominator = dominator == NULL ? useBlock : dominators.findNearestCommonDominator(dominator, useBlock);
+    }
+    return dominator == NULL ? slot->getParent() : dominator;
+  }
+
+  /**
+   * Returns the block in which a lazy frame can be allocated for slots whose uses block
+   * dominates: block itself if it is outside of every loop, or else the preheader of the
+   * outermost loop around it. Returns NULL if that is the entry block, if there is no
+   * preheader, or if it may run more than once per call.
+   */
+  BasicBlock * getLazyBlock(BasicBlock * block, LoopInfo & loops) {
+    Loop * loop = loops.getLoopFor(block);
+    if (loop != NULL) {
+      while (loop->getParentLoop() != NULL) loop = loop->getParentLoop();
+      block = loop->getLoopPreheader();
+    }
+    if (block == NULL || block == &block->getParent()->getEntryBlock() || isInCycle(block)) return NULL;
+    return block;
+  }
+
+  /**
+   * Returns the estimated cost per call of a frame of size bytes, allocated in block, whose
+   * slots are used at most loopDepth loops deep. Blocks other than the entry block must not
+   * be in a cycle.
+   */
+  double getFrameCost(uint64_t size, BasicBlock * block, unsigned loopDepth, BlockFrequencyInfo & frequencies) {
+    double allocationCost = (size <= SMALL_FRAME_SIZE ? 1.0 : LARGE_FRAME_COST) + (double) size / SMALL_FRAME_SIZE;
+    BasicBlock * entry = &block->getParent()->getEntryBlock();
+    if (block == entry) return allocationCost;
 
-        if (stackSlot == val)
-          //This load is safe; continue on to the next use.
+    double frequency = (double) frequencies.getBlockFreq(block).getFrequency() / frequencies.getBlockFreq(entry).getFrequency();
+    return std::min(frequency, 1.0) * allocationCost + LAZY_FRAME_COST + loopDepth * LOOP_FRAME_COST;
+  }
+
+  /**
+   * Tosses allocas into a frame of their own, which is allocated in block, and only on the
+   * paths through it. Its pointer is kept in a stack slot that starts out null, and is freed
+   * before every terminator, which is a no-op if it was never allocated. block must dominate
+   * every use of the allocas, and must not be in a cycle.
+   */
+  void tossLazily(std::vector<AllocaInst *> & allocas, BasicBlock * block, set<Instruction *> & terminators) {
+    LLVMContext & ctx = currentFunction->getContext();
+    Type * i8PtrType = Type::getInt8PtrTy(ctx);
+
+    std::vector<Type *> structElements;
+    unsigned alignment = 1;
+    for (unsigned a = 0; a < allocas.size(); a++) {
+      structElements.push_back(allocas[a]->getAllocatedType());
+      if (getAlignment(allocas[a]) > alignment) alignment = getAlignment(allocas[a]);
+    }
+    StructType * structType = StructType::create(structElements, "locals.lazy", true);
+    Constant * structSize = ConstantExpr::getSizeOf(structType);
+
+    Instruction * entryStart = currentFunction->getEntryBlock().getFirstNonPHI();
+    AllocaInst * holder = new AllocaInst(i8PtrType, "ht.lazy", entryStart);
+    new StoreInst(ConstantPointerNull::get(cast<PointerType>(i8PtrType)), holder, entryStart);
+
+    set<Instruction *> noTerminators;
+    Instruction * insertBefore = block->getFirstInsertionPt();
+    Instruction * frame = callMalloc(insertBefore, structType, structSize, alignment, noTerminators);
+    Instruction * store = new StoreInst(new BitCastInst(frame, i8PtrType, "", insertBefore), holder, insertBefore);
+    stats->addDynamicToss(currentFunction, structSize, store, terminators);
+
+    for (set<Instruction *>::iterator t = terminators.begin(); t != terminators.end(); t++) {
+      Value * memory = new LoadInst(holder, "", *t);
+      callFree(memory, castToPtrType(structSize, *t), ConstantInt::get(ptrType, alignment, false), *t);
+    }
+
+    const StructLayout * layout = NULL;
+    if (ANNOTATE_FRAMES && ALLOCATOR_ABI) layout = targetData->getStructLayout(structType);
+
+    for (unsigned a = 0; a < allocas.size(); a++) {
+      Value * indices[] = { ConstantInt::get(Type::getInt32Ty(ctx), 0, false), ConstantInt::get(Type::getInt32Ty(ctx), a, false) };
+      GetElementPtrInst * field = GetElementPtrInst::Create(frame, indices, "", insertBefore);
+      replaceAlloca(allocas[a], field);
+      if (layout != NULL) setFieldAlignment(field, MinAlign(alignment, layout->getElementOffset(a)));
+    }
+  }
+
+  static bool isLargerSlot(const std::pair<uint64_t, AllocaInst *> & a, const std::pair<uint64_t, AllocaInst *> & b) {
+    return a.first > b.first;
+  }
+
+  /**
+   * Tosses allocas the way the cost model finds cheapest. Each slot goes to one of:
+   *
+   *  - the batched frame, which is allocated on entry,
+   *  - a frame of its own, allocated lazily in the block that dominates its uses,
+   *  - the cold group, which shares one frame allocated lazily in the block that dominates
+   *    the uses of all of its slots.
+   *
+   * Lazy frames are only possible in blocks that run at most once per call. Slots used in a
+   * loop get theirs in the preheader of the outermost loop around their uses, and cost more
+   * the deeper those uses are. Slots start out batched, and, largest first, move to whichever place lowers the estimated cost per call
+   * the most (see getFrameCost). Moving one slot can make moving another worth it (say, the
+   * last one left in the batched frame), so this repeats until no slot moves. Slots that stay
+   * batched are tossed as usual.
+   */
+  void tossByCostModel(set<AllocaInst *> & allocas) {
+    Function * f = currentFunction;
+    BlockFrequencyInfo & frequencies = getAnalysis<BlockFrequencyInfo>(*f);
+    DominatorTree & dominators = getAnalysis<DominatorTree>(*f);
+    LoopInfo & loops = getAnalysis<LoopInfo>(*f);
+    BasicBlock * entry = &f->getEntryBlock();
+
+    //Largest first, since they have the most to gain from leaving the batched frame.
+    std::vector<std::pair<uint64_t, AllocaInst *> > slots;
+    uint64_t batchedSize = 0;
+    for (set<AllocaInst *>::iterator a_iter = allocas.begin(); a_iter != allocas.end(); a_iter++) {
+      uint64_t size = targetData->getTypeAllocSize((*a_iter)->getAllocatedType());
+      slots.push_back(std::make_pair(size, *a_iter));
+      batchedSize += size;
+    }
+    std::stable_sort(slots.begin(), slots.end(), isLargerSlot);
+
+    double batchedCost = getFrameCost(batchedSize, entry, 0, frequencies);
+    double cost = batchedCost;
+    unsigned numBatched = slots.size();
+    std::vector<AllocaInst *> cold;
+    uint64_t coldSize = 0;
+    BasicBlock * coldBlock = NULL;
+    //The block that dominates the uses of the cold slots, and their deepest loop depth.
+    BasicBlock * coldUseBlock = NULL;
+    unsigned coldDepth = 0;
+    std::vector<std::pair<AllocaInst *, BasicBlock *> > separate;
+
+    //Slots that could go into a lazy frame, the block that dominates their uses, and the
+    //block their frame would be allocated in.
+    std::vector<std::pair<uint64_t, AllocaInst *> > candidates;
+    std::vector<BasicBlock *> useBlocks;
+    std::vector<BasicBlock *> lazyBlocks;
+    for (unsigned s = 0; s < slots.size(); s++) {
+      BasicBlock * useBlock = getUseDominator(slots[s].second, dominators);
+      BasicBlock * lazyBlock = getLazyBlock(useBlock, loops);
+      if (lazyBlock == NULL) continue;
+      candidates.push_back(slots[s]);
+      useBlocks.push_back(useBlock);
+      lazyBlocks.push_back(lazyBlock);
+    }
+
+    std::vector<bool> moved(candidates.size(), false);
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (unsigned s = 0; s < candidates.size(); s++) {
+        if (moved[s]) continue;
+        uint64_t size = candidates[s].first;
+        AllocaInst * slot = candidates[s].second;
+        BasicBlock * useBlock = useBlocks[s];
+        unsigned depth = loops.getLoopDepth(useBlock);
+
+        //What the batched frame saves without the slot.
+        double batchedSaving = getFrameCost(batchedSize, entry, 0, frequencies)
+            - (numBatched == 1 ? 0 : getFrameCost(batchedSize - size, entry, 0, frequencies));
+
+        double separateCost = getFrameCost(size, lazyBlocks[s], depth, frequencies);
+
+        //What the cold group costs on top with the slot, if it can still be lazy.
+        double coldCost = -1;
+        BasicBlock * newColdUseBlock = coldUseBlock == NULL ? useBlock : dominators.findNearestCommonDominator(coldUseBlock, useBlock);
+        BasicBlock * newColdBlock = getLazyBlock(newColdUseBlock, loops);
+        unsigned newColdDepth = std::max(coldDepth, depth);
+        if (newColdBlock != NULL) {
+          coldCost = getFrameCost(coldSize + size, newColdBlock, newColdDepth, frequencies)
+              - (coldBlock == NULL ? 0 : getFrameCost(coldSize, coldBlock, coldDepth, frequencies));
+        }
+
+        if (coldCost >= 0 && coldCost <= separateCost && coldCost < batchedSaving) {
+          cold.push_back(slot);
+          coldSize += size;
+          coldBlock = newColdBlock;
+          coldUseBlock = newColdUseBlock;
+          coldDepth = newColdDepth;
+          cost += coldCost - batchedSaving;
+        }
+        else if (separateCost < batchedSaving) {
+          separate.push_back(std::make_pair(slot, lazyBlocks[s]));
+          cost += separateCost - batchedSaving;
+        }
+        else {
           continue;
+        }
+        allocas.erase(slot);
+        batchedSize -= size;
+        numBatched--;
+        moved[s] = true;
+        changed = true;
       }
-      //OK if stored into.
-      else if (isa<StoreInst>(useVal))
-      {
-        StoreInst * store = dyn_cast<StoreInst>(useVal);
-        //Are we storing TO this stack slot?
-        Value * val = store->getOperand(0);
+    }
 
-        if (stackSlot == val)
-          //This store is safe.
-          continue;
+    stats->setTossPlan(f, numBatched, separate.size(), cold.size(), cost, batchedCost);
+
+    //The lazy frames first, while the batched slots are still in the entry block.
+    for (unsigned s = 0; s < separate.size(); s++) {
+      std::vector<AllocaInst *> own(1, separate[s].first);
+      tossLazily(own, separate[s].second, terminatorInsts);
+    }
+    if (!cold.empty()) tossLazily(cold, coldBlock, terminatorInsts);
+
+    tossTogetherElement(allocas, terminatorInsts);
+  }
+
+  /**
+   * Returns true if ptr may point into a tossed frame: one that the current function
+   * allocated, or one that reached it from elsewhere, through an argument, memory, or the
+   * result of a call. Stack slots that stayed on the stack, globals other than static frames,
+   * and fresh allocations that are not our frames are never tossed frames. Nothing is when
+   * nothing is tossed. Must be called after tossing.
+   */
+  bool mayPointIntoTossedFrame(Value * ptr) {
+    if (TOSS_NONE) return false;
+
+    Value * object = GetUnderlyingObject(ptr);
+    if (tossedFrameObjects.count(object) != 0) return true;
+    return !isa<GlobalValue>(object) && !isa<AllocaInst>(object) && !isNoAliasCall(object)
+        && !isa<ConstantPointerNull>(object) && !isa<UndefValue>(object);
+  }
+
+  /**
+   * Checks if inst releases a tossed frame: a call to free (or heaptoss_free) that callFree
+   * inserted. The program's own frees are not ours to move.
+   */
+  bool isFrameRelease(Instruction * inst) {
+    return frameReleases.count(inst) != 0;
+  }
+
+  /**
+   * Moves the frame releases that callMalloc put between a tail call and the return after it
+   * above the call, so that the call stays in tail position:
+   *
+   *   %r = tail call @g(...)        =>   call @heaptoss_free(%frame, ...)
+   *   call @heaptoss_free(%frame)        %r = tail call @g(...)
+   *   ret %r                             ret %r
+   *
+   * The tail marker says that g does not touch our stack slots, tossed ones included, other
+   * than through its arguments. If an argument may point into the frame, g still needs it,
+   * so the call is left where it is. So is a call followed by anything but the releases
+   * (e.g. the context profile restoring its depth, or shadow slots being reloaded), since
+   * it is not in tail position either way.
+   */
+  void preserveTailCalls(Function * f) {
+    for (Function::iterator b = f->begin(); b != f->end(); b++) {
+      ReturnInst * ret = dyn_cast<ReturnInst>(b->getTerminator());
+      if (ret == NULL) continue;
+
+      //The releases right before the return, and the casts that only feed them, last first.
+      std::vector<Instruction *> releases;
+      set<Instruction *> releaseSet;
+      BasicBlock::iterator i = ret;
+      while (i != b->begin()) {
+        i--;
+        //Lazy frames are loaded from their holder right before they are freed.
+        bool feedsRelease = (isa<BitCastInst>(i) || isa<LoadInst>(i)) && i->hasOneUse()
+            && releaseSet.count(cast<Instruction>(i->use_back())) != 0;
+        if (!isFrameRelease(i) && !feedsRelease) break;
+        releases.push_back(i);
+        releaseSet.insert(i);
       }
-      else if (isa<GetElementPtrInst>(useVal))
-      {
-        GetElementPtrInst * getEmPtr = dyn_cast<GetElementPtrInst>(useVal);
 
-        //The stack slot should be the first argument.
-        Value * arg0 = getEmPtr->getOperand(0);
+      CallInst * call = dyn_cast<CallInst>(i);
+      if (releases.empty() || call == NULL || !call->isTailCall() || releaseSet.count(call) != 0) continue;
+      if (ret->getReturnValue() != NULL && ret->getReturnValue() != call) continue;
 
-        if (arg0 == stackSlot)
-        {
-          //It's only OK if the element ptr can't escape.
-          if (!canEscape(useVal))
-            continue;
-        }
+      bool argsMayPointIntoFrame = false;
+      for (unsigned a = 0; a < call->getNumArgOperands(); a++) {
+        Value * arg = call->getArgOperand(a);
+        if (PtrToIntInst * ptrToInt = dyn_cast<PtrToIntInst>(arg)) arg = ptrToInt->getOperand(0);
+        if (arg->getType()->isPointerTy() && mayPointIntoTossedFrame(arg)) argsMayPointIntoFrame = true;
       }
+      if (argsMayPointIntoFrame) continue;
 
-      /**errs() << "Violater Instruction for variable ";
-      stackSlot->print(errs());
-      errs() << ":\n";
-      useVal->print(errs());
-      errs() << "\n";**/
+      for (unsigned r = releases.size(); r > 0; r--) {
+        releases[r - 1]->moveBefore(call);
+      }
+    }
+  }
 
-      //Anything else is bad!
-      return true;
+  /**
+   * Tossed variables live in packed structs, so a MemIntrinsic that may touch one can not rely
+   * on its alignment. Rather than dropping its alignment to 1 everywhere, we emit the original
+   * MemIntrinsic and one with an alignment of 1, and pick one by checking the alignment of the
+   * operands at runtime:
+   *
+   *   head:          %isaligned = ((dest | src) & (align - 1)) == 0
+   *                  br %isaligned, ht.mi.aligned, ht.mi.unaligned
+   *   ht.mi.aligned:   memcpy(dest, src, len, align)
+   *   ht.mi.unaligned: memcpy(dest, src, len, 1)
+   *   ht.mi.cont:    ...
+   */
+  void fixMemIntrinsicAlignment(MemIntrinsic * memIntrinsic) {
+    LLVMContext & ctx = memIntrinsic->getContext();
+    Constant * noAlignment = ConstantInt::get(Type::getInt32Ty(ctx), 1, false);
+    unsigned alignment = memIntrinsic->getAlignment();
+    MemTransferInst * transfer = dyn_cast<MemTransferInst>(memIntrinsic);
+
+    if (!VERSION_MEMINTRINSICS) {
+      memIntrinsic->setAlignment(noAlignment);
+      stats->addMemIntrinsic(memIntrinsic, MI_PATH_UNVERSIONED);
+      return;
     }
 
-    //We can confidently say that all uses are store/loads, and this variable can not escape.
-    return false;
+    bool mayTouchTossed = mayPointIntoTossedFrame(memIntrinsic->getRawDest())
+        || (transfer != NULL && mayPointIntoTossedFrame(transfer->getRawSource()));
+
+    //Nothing to gain (or nothing to fear).
+    if (alignment <= 1 || !mayTouchTossed) {
+      stats->addMemIntrinsic(memIntrinsic, MI_PATH_UNVERSIONED);
+      return;
+    }
+
+    BasicBlock * head = memIntrinsic->getParent();
+    Function * f = head->getParent();
+    BasicBlock * tail = head->splitBasicBlock(memIntrinsic, "ht.mi.cont");
+    BasicBlock * alignedBlock = BasicBlock::Create(ctx, "ht.mi.aligned", f, tail);
+    BasicBlock * unalignedBlock = BasicBlock::Create(ctx, "ht.mi.unaligned", f, tail);
+
+    //Replace the unconditional branch that splitBasicBlock left with the alignment check.
+    TerminatorInst * oldBranch = head->getTerminator();
+    Value * address = new PtrToIntInst(memIntrinsic->getRawDest(), ptrType, "", oldBranch);
+    if (transfer != NULL) {
+      Value * srcAddress = new PtrToIntInst(transfer->getRawSource(), ptrType, "", oldBranch);
+      address = BinaryOperator::CreateOr(address, srcAddress, "", oldBranch);
+    }
+    Value * lowBits = BinaryOperator::CreateAnd(address, ConstantInt::get(ptrType, alignment - 1, false), "", oldBranch);
+    Value * isAligned = new ICmpInst(oldBranch, ICmpInst::ICMP_EQ, lowBits, ConstantInt::get(ptrType, 0, false), "ht.mi.isaligned");
+    BranchInst::Create(alignedBlock, unalignedBlock, isAligned, head);
+    oldBranch->eraseFromParent();
+
+    MemIntrinsic * alignedMemIntrinsic = cast<MemIntrinsic>(memIntrinsic->clone());
+    alignedBlock->getInstList().push_back(alignedMemIntrinsic);
+    BranchInst::Create(tail, alignedBlock);
+
+    MemIntrinsic * unalignedMemIntrinsic = cast<MemIntrinsic>(memIntrinsic->clone());
+    unalignedMemIntrinsic->setAlignment(noAlignment);
+    unalignedBlock->getInstList().push_back(unalignedMemIntrinsic);
+    BranchInst::Create(tail, unalignedBlock);
+
+    memIntrinsic->eraseFromParent();
+
+    stats->addMemIntrinsic(alignedMemIntrinsic, MI_PATH_ALIGNED);
+    stats->addMemIntrinsic(unalignedMemIntrinsic, MI_PATH_UNALIGNED);
   }
 
   /**
@@ -435,10 +1360,7 @@ struct HeapTossPass: public ModulePass {
       //This case must go BEFORE CallInst, or else it will never execute!
       //(MemIntrinsics are CallInsts)
       else if (isa<MemIntrinsic>(i)) {
-        MemIntrinsic * memintrinsic = dyn_cast<MemIntrinsic>(i);
-        //TODO: Maybe alias analysis can help me here.
-        memintrinsic->setAlignment(ConstantInt::get(Type::getInt32Ty(i->getContext()), 1, false));
-        stats->addMemIntrinsic(memintrinsic);
+        memIntrinsics.push_back(dyn_cast<MemIntrinsic>(i));
       }
       //For the case of calls like exit() that do not return.
       else if (isa<CallInst>(i)) {
@@ -468,6 +1390,575 @@ struct HeapTossPass: public ModulePass {
   }
 
 
+  /**
+   * Returns the largest size the given malloc can be called with, or 0 if it is not known.
+   */
+  uint64_t getMaxMallocSize(CallInst * call) {
+    Value * size = call->getArgOperand(0);
+    if (ConstantInt * constantSize = dyn_cast<ConstantInt>(size)) {
+      return constantSize->getZExtValue();
+    }
+
+    //Small buffers sized by a flag.
+    if (SelectInst * select = dyn_cast<SelectInst>(size)) {
+      ConstantInt * trueSize = dyn_cast<ConstantInt>(select->getTrueValue());
+      ConstantInt * falseSize = dyn_cast<ConstantInt>(select->getFalseValue());
+      if (trueSize != NULL && falseSize != NULL) {
+        return std::max(trueSize->getZExtValue(), falseSize->getZExtValue());
+      }
+    }
+    return 0;
+  }
+
+  /**
+   * Checks if memory from malloc can escape the function that allocated it. It does not if
+   * it (or a pointer derived from it by casts and GEPs) is only loaded from, stored into,
+   * compared, copied into or out of or set by a MemIntrinsic, or freed. Adds the calls to
+   * free to frees.
+   *
+   * Since no pointer into it survives in memory or flows through a PHI, an earlier call's
+   * memory is dead by the time the same malloc runs again, so one stack slot can serve
+   * every call.
+   */
+  bool mallocMayEscape(CallInst * call, std::vector<CallInst *> & frees) {
+    std::vector<Value *> worklist;
+    worklist.push_back(call);
+
+    while (!worklist.empty()) {
+      Value * ptr = worklist.back();
+      worklist.pop_back();
+
+      for (Value::use_iterator u = ptr->use_begin(); u != ptr->use_end(); u++) {
+        Instruction * use = dyn_cast<Instruction>(*u);
+        if (use == NULL) return true;
+
+        if (isa<BitCastInst>(use) || (isa<GetElementPtrInst>(use) && use->getOperand(0) == ptr)) {
+          worklist.push_back(use);
+        }
+        else if (isa<LoadInst>(use) || isa<ICmpInst>(use) || isa<DbgInfoIntrinsic>(use)) {
+          continue;
+        }
+        else if (StoreInst * store = dyn_cast<StoreInst>(use)) {
+          if (store->getValueOperand() == ptr) return true;
+        }
+        //A MemIntrinsic only moves the bytes that ptr points to, never ptr itself.
+        else if (MemIntrinsic * memIntrinsic = dyn_cast<MemIntrinsic>(use)) {
+          MemTransferInst * transfer = dyn_cast<MemTransferInst>(memIntrinsic);
+          bool isDest = memIntrinsic->getRawDest() == ptr;
+          bool isSource = transfer != NULL && transfer->getRawSource() == ptr;
+          if (!isDest && !isSource) return true;
+        }
+        else if (CallInst * freeCall = dyn_cast<CallInst>(use)) {
+          Function * callee = freeCall->getCalledFunction();
+          if (callee == NULL || callee->getName() != "free" || freeCall->getNumArgOperands() != 1) return true;
+          frees.push_back(freeCall);
+        }
+        else {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Turns small mallocs in f whose memory can not escape into stack slots in the entry
+   * block, and removes their frees.
+   */
+  void demoteMallocs(Function * f) {
+    std::vector<CallInst *> mallocs;
+    for (Function::iterator b = f->begin(); b != f->end(); b++) {
+      for (BasicBlock::iterator i = b->begin(); i != b->end(); i++) {
+        CallInst * call = dyn_cast<CallInst>(i);
+        if (call == NULL || call->getNumArgOperands() != 1) continue;
+
+        Function * callee = call->getCalledFunction();
+        if (callee != NULL && callee->getName() == "malloc" && callee->isDeclaration()) {
+          mallocs.push_back(call);
+        }
+      }
+    }
+
+    LLVMContext & ctx = f->getContext();
+    Instruction * entryStart = f->getEntryBlock().begin();
+    for (unsigned m = 0; m < mallocs.size(); m++) {
+      CallInst * call = mallocs[m];
+      uint64_t size = getMaxMallocSize(call);
+      if (size == 0 || size > DEMOTE_MAX_SIZE) continue;
+
+      std::vector<CallInst *> frees;
+      if (mallocMayEscape(call, frees)) continue;
+
+      //malloc's alignment, which the program may rely on.
+      AllocaInst * slot = new AllocaInst(Type::getInt8Ty(ctx), ConstantInt::get(Type::getInt32Ty(ctx), size, false),
+          DEFAULT_FRAME_ALIGNMENT, "ht.demoted", entryStart);
+      Value * replacement = slot;
+      if (call->getType() != slot->getType()) replacement = new BitCastInst(slot, call->getType(), "", call);
+
+      //Remove the frees, along with the casts that only fed them.
+      for (unsigned fr = 0; fr < frees.size(); fr++) {
+        Instruction * ptr = dyn_cast<Instruction>(frees[fr]->getArgOperand(0));
+        frees[fr]->eraseFromParent();
+        while (ptr != NULL && ptr != call && isa<CastInst>(ptr) && ptr->use_empty()) {
+          Instruction * operand = dyn_cast<Instruction>(ptr->getOperand(0));
+          ptr->eraseFromParent();
+          ptr = operand;
+        }
+      }
+      call->replaceAllUsesWith(replacement);
+      call->eraseFromParent();
+      stats->addDemotedMalloc(f);
+    }
+  }
+
+  /**
+   * Checks if every use of fieldPtr, a pointer into one field of a struct slot, stays within
+   * that field: it is loaded from, stored into, compared, or handed on (to a call, a store
+   * or a return) with the type it has. GEPs on it must start with index 0, and are checked
+   * the same way. Casts, pointer arithmetic and merges could reach the other fields.
+   */
+  bool staysInField(Instruction * fieldPtr) {
+    std::vector<Instruction *> worklist;
+    worklist.push_back(fieldPtr);
+
+    while (!worklist.empty()) {
+      Instruction * ptr = worklist.back();
+      worklist.pop_back();
+
+      for (Value::use_iterator u = ptr->use_begin(); u != ptr->use_end(); u++) {
+        Instruction * use = dyn_cast<Instruction>(*u);
+        if (use == NULL) return false;
+
+        if (GetElementPtrInst * gep = dyn_cast<GetElementPtrInst>(use)) {
+          ConstantInt * first = dyn_cast<ConstantInt>(gep->getOperand(1));
+          if (gep->getPointerOperand() != ptr || first == NULL || !first->isZero()) return false;
+          worklist.push_back(gep);
+        }
+        else if (!isa<LoadInst>(use) && !isa<StoreInst>(use) && !isa<ICmpInst>(use)
+            && !isa<CallInst>(use) && !isa<InvokeInst>(use) && !isa<ReturnInst>(use)) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Checks if a struct stack slot can be split into one slot per field. Every use must be a
+   * GEP that picks a field with constant indices and whose pointer stays within that field,
+   * or a cast that only feeds memcpys, memmoves and memsets of the whole slot.
+   *
+   * Arrays are never split: a pointer to one element is a pointer to the whole array.
+   */
+  bool canSplit(AllocaInst * alloca) {
+    StructType * structType = dyn_cast<StructType>(alloca->getAllocatedType());
+    unsigned numFields = structType == NULL ? 0 : structType->getNumElements();
+    ConstantInt * arraySize = dyn_cast<ConstantInt>(alloca->getArraySize());
+    if (numFields < 2 || numFields > MAX_SPLIT_FIELDS || arraySize == NULL || !arraySize->isOne()) return false;
+
+    uint64_t size = targetData->getTypeAllocSize(alloca->getAllocatedType());
+    for (Value::use_iterator u = alloca->use_begin(); u != alloca->use_end(); u++) {
+      if (GetElementPtrInst * gep = dyn_cast<GetElementPtrInst>(*u)) {
+        if (gep->getNumOperands() < 3 || gep->getPointerOperand() != alloca) return false;
+        ConstantInt * first = dyn_cast<ConstantInt>(gep->getOperand(1));
+        ConstantInt * field = dyn_cast<ConstantInt>(gep->getOperand(2));
+        if (first == NULL || !first->isZero() || field == NULL || field->getZExtValue() >= numFields) return false;
+        if (!staysInField(gep)) return false;
+      }
+      else if (BitCastInst * cast = dyn_cast<BitCastInst>(*u)) {
+        if (cast->getType() != Type::getInt8PtrTy(alloca->getContext())) return false;
+        for (Value::use_iterator cu = cast->use_begin(); cu != cast->use_end(); cu++) {
+          MemIntrinsic * memIntrinsic = dyn_cast<MemIntrinsic>(*cu);
+          if (memIntrinsic == NULL) return false;
+
+          ConstantInt * length = dyn_cast<ConstantInt>(memIntrinsic->getLength());
+          if (length == NULL || length->getZExtValue() != size) return false;
+
+          //Copies of the slot onto itself.
+          MemTransferInst * transfer = dyn_cast<MemTransferInst>(memIntrinsic);
+          if (transfer != NULL && transfer->getDest() == alloca && transfer->getSource() == alloca) return false;
+        }
+      }
+      else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Replaces a memcpy, memmove or memset of a whole split slot with one per field. slot is
+   * the cast of the slot that memIntrinsic uses, and offsets holds each field's offset in
+   * the original slot.
+   */
+  void splitMemIntrinsic(MemIntrinsic * memIntrinsic, Value * slot,
+      std::vector<AllocaInst *> & fields, std::vector<uint64_t> & offsets) {
+    LLVMContext & ctx = memIntrinsic->getContext();
+    Type * bytePtrType = Type::getInt8PtrTy(ctx);
+    MemTransferInst * transfer = dyn_cast<MemTransferInst>(memIntrinsic);
+    bool slotIsDest = memIntrinsic->getRawDest() == slot;
+    Value * other = NULL;
+    if (transfer != NULL) {
+      other = slotIsDest ? transfer->getRawSource() : transfer->getRawDest();
+      if (other->getType() != bytePtrType) other = new BitCastInst(other, bytePtrType, "", memIntrinsic);
+    }
+    unsigned alignment = std::max(memIntrinsic->getAlignment(), 1U);
+
+    for (unsigned i = 0; i < fields.size(); i++) {
+      uint64_t size = targetData->getTypeAllocSize(fields[i]->getAllocatedType());
+      if (size == 0) continue;
+
+      MemIntrinsic * fieldMemIntrinsic = cast<MemIntrinsic>(memIntrinsic->clone());
+      fieldMemIntrinsic->insertBefore(memIntrinsic);
+      fieldMemIntrinsic->setLength(ConstantInt::get(memIntrinsic->getLength()->getType(), size, false));
+      fieldMemIntrinsic->setAlignment(ConstantInt::get(Type::getInt32Ty(ctx), MinAlign(alignment, offsets[i]), false));
+
+      Value * fieldPtr = new BitCastInst(fields[i], bytePtrType, "", fieldMemIntrinsic);
+      if (transfer == NULL) {
+        fieldMemIntrinsic->setDest(fieldPtr);
+        continue;
+      }
+
+      Value * otherPtr = GetElementPtrInst::CreateInBounds(other,
+          ConstantInt::get(Type::getInt64Ty(ctx), offsets[i], false), "", fieldMemIntrinsic);
+      fieldMemIntrinsic->setDest(slotIsDest ? fieldPtr : otherPtr);
+      cast<MemTransferInst>(fieldMemIntrinsic)->setSource(slotIsDest ? otherPtr : fieldPtr);
+    }
+
+    memIntrinsic->eraseFromParent();
+  }
+
+  /**
+   * Replaces an aggregate stack slot that canSplit accepts with one slot per field, and adds
+   * them to fields.
+   */
+  void splitAggregate(AllocaInst * alloca, set<AllocaInst *> & fields) {
+    StructType * structType = cast<StructType>(alloca->getAllocatedType());
+    const StructLayout * layout = targetData->getStructLayout(structType);
+    unsigned alignment = getAlignment(alloca);
+
+    std::vector<AllocaInst *> fieldSlots;
+    std::vector<uint64_t> offsets;
+    for (unsigned i = 0; i < structType->getNumElements(); i++) {
+      Type * fieldType = structType->getElementType(i);
+      uint64_t offset = layout->getElementOffset(i);
+
+      AllocaInst * field = new AllocaInst(fieldType, 0, MinAlign(alignment, offset), alloca->getName() + "." + Twine(i), alloca);
+      fieldSlots.push_back(field);
+      offsets.push_back(offset);
+      fields.insert(field);
+    }
+
+    while (!alloca->use_empty()) {
+      Instruction * use = cast<Instruction>(*alloca->use_begin());
+
+      if (GetElementPtrInst * gep = dyn_cast<GetElementPtrInst>(use)) {
+        //&slot[0].field.rest... becomes &field[0].rest...
+        AllocaInst * field = fieldSlots[cast<ConstantInt>(gep->getOperand(2))->getZExtValue()];
+        Value * replacement = field;
+        if (gep->getNumOperands() > 3) {
+          std::vector<Value *> indices;
+          indices.push_back(gep->getOperand(1));
+          for (unsigned op = 3; op < gep->getNumOperands(); op++) indices.push_back(gep->getOperand(op));
+          GetElementPtrInst * fieldGep = GetElementPtrInst::Create(field, indices, "", gep);
+          fieldGep->setIsInBounds(gep->isInBounds());
+          replacement = fieldGep;
+        }
+        replacement->takeName(gep);
+        gep->replaceAllUsesWith(replacement);
+        gep->eraseFromParent();
+        continue;
+      }
+
+      while (!use->use_empty()) {
+        splitMemIntrinsic(cast<MemIntrinsic>(*use->use_begin()), use, fieldSlots, offsets);
+      }
+      use->eraseFromParent();
+    }
+
+    if (DbgDeclareInst * declare = FindAllocaDbgDeclare(alloca)) declare->eraseFromParent();
+    fields.erase(alloca);
+    alloca->eraseFromParent();
+  }
+
+  /**
+   * Splits the aggregate stack slots of f that escape into one slot per field, like SROA
+   * does, so that only the fields that escape are tossed. Fields that are aggregates
+   * themselves are split again if they escape. Reports the bytes that stay on the stack.
+   */
+  void splitAggregates(Function * f) {
+    set<AllocaInst *> fields;
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      escapeAnalysis->analyze(*f);
+
+      std::vector<AllocaInst *> candidates;
+      for (Function::iterator b = f->begin(); b != f->end(); b++) {
+        for (BasicBlock::iterator i = b->begin(); i != b->end(); i++) {
+          AllocaInst * alloca = dyn_cast<AllocaInst>(i);
+          if (alloca != NULL && escapeAnalysis->canEscape(alloca)) candidates.push_back(alloca);
+        }
+      }
+
+      for (unsigned c = 0; c < candidates.size(); c++) {
+        if (!canSplit(candidates[c])) continue;
+        splitAggregate(candidates[c], fields);
+        changed = true;
+      }
+    }
+
+    uint64_t keptBytes = 0;
+    for (set<AllocaInst *>::iterator field = fields.begin(); field != fields.end(); field++) {
+      if (!escapeAnalysis->canEscape(*field)) keptBytes += targetData->getTypeAllocSize((*field)->getAllocatedType());
+    }
+    stats->addSplitBytes(f, keptBytes);
+  }
+
+  /**
+   * Returns a copy of f as it is now, which must be before the pass changes anything in it.
+   * The copy is internal and marked always_inline, so that an inliner that runs after us
+   * (e.g. opt -heaptoss -always-inline) moves it into the untossed path of f. Inside
+   * clang's pipeline, no inliner runs after us, and the untossed path makes one extra call.
+   */
+  Function * cloneUntossedVersion(Function * f) {
+    ValueToValueMapTy vmap;
+    Function * clone = CloneFunction(f, vmap, false);
+    clone->setName(f->getName() + ".htuntossed");
+    clone->setLinkage(GlobalValue::InternalLinkage);
+    clone->setVisibility(GlobalValue::DefaultVisibility);
+    clone->removeFnAttr(Attribute::NoInline);
+    clone->addFnAttr(Attribute::AlwaysInline);
+    f->getParent()->getFunctionList().push_back(clone);
+    return clone;
+  }
+
+  /**
+   * Makes f pick its body on entry. It runs the tossed body if its toss flag is set, and
+   * forwards to its untossed version otherwise:
+   *
+   *   ht.dispatch:   (static allocas of f)
+   *                  %tossing = load i8* @f.httoss
+   *                  br (%tossing != 0), entry, ht.untossed
+   *   ht.untossed:   %result = call @f.htuntossed(args...)
+   *                  ret %result
+   *   entry:         (the tossed body)
+   *
+   * The static allocas that stayed on the stack move to the new entry block, so that they
+   * stay static.
+   */
+  void insertVersionDispatch(Function * f, Function * untossed) {
+    Module * M = f->getParent();
+    LLVMContext & ctx = M->getContext();
+    Type * i8Type = Type::getInt8Ty(ctx);
+
+    GlobalVariable * tossFlag = new GlobalVariable(*M, i8Type, false, GlobalValue::InternalLinkage,
+        ConstantInt::get(i8Type, 1, false), f->getName() + ".httoss");
+
+    BasicBlock * body = &f->getEntryBlock();
+    BasicBlock * dispatch = BasicBlock::Create(ctx, "ht.dispatch", f, body);
+    BasicBlock * untossedBlock = BasicBlock::Create(ctx, "ht.untossed", f, body);
+
+    for (BasicBlock::iterator i = body->begin(); i != body->end();) {
+      AllocaInst * alloca = dyn_cast<AllocaInst>(i++);
+      if (alloca != NULL && isa<Constant>(alloca->getArraySize())) {
+        alloca->removeFromParent();
+        dispatch->getInstList().push_back(alloca);
+      }
+    }
+    Value * tossing = new LoadInst(tossFlag, "ht.tossing", dispatch);
+    Value * isTossing = new ICmpInst(*dispatch, ICmpInst::ICMP_NE, tossing, ConstantInt::get(i8Type, 0, false));
+    BranchInst::Create(body, untossedBlock, isTossing, dispatch);
+
+    std::vector<Value *> args;
+    for (Function::arg_iterator arg = f->arg_begin(); arg != f->arg_end(); arg++) {
+      args.push_back(arg);
+    }
+    CallInst * call = CallInst::Create(untossed, args, "", untossedBlock);
+    call->setCallingConv(untossed->getCallingConv());
+    call->setAttributes(untossed->getAttributes());
+    Instruction * ret;
+    if (f->getReturnType()->isVoidTy()) {
+      ret = ReturnInst::Create(ctx, untossedBlock);
+    }
+    else {
+      ret = ReturnInst::Create(ctx, call, untossedBlock);
+    }
+    stats->addUntossedVersion(f, untossed, call, ret);
+
+    versionedFunctions.push_back(f);
+    tossFlags.push_back(tossFlag);
+  }
+
+  /**
+   * Adds a module constructor that registers the module's toss flags with the runtime, as a
+   * table of { size_t numFunctions, const char ** fcnNames, char ** tossFlags }. The layout
+   * must match HeapTossVersionTable in HeapTossVersions.cpp.
+   */
+  void insertVersionRegistration(Module & M) {
+    if (versionedFunctions.empty()) return;
+
+    LLVMContext & ctx = M.getContext();
+    Type * i8PtrType = Type::getInt8PtrTy(ctx);
+
+    std::vector<Constant *> names;
+    std::vector<Constant *> flags;
+    for (unsigned v = 0; v < versionedFunctions.size(); v++) {
+      names.push_back(stats->getStringPtr(M, versionedFunctions[v]->getName(), "__heaptoss_version_name"));
+      flags.push_back(tossFlags[v]);
+    }
+    ArrayType * tableType = ArrayType::get(i8PtrType, names.size());
+    GlobalVariable * namesTable = new GlobalVariable(M, tableType, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(tableType, names), "__heaptoss_version_names");
+    GlobalVariable * flagsTable = new GlobalVariable(M, tableType, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(tableType, flags), "__heaptoss_version_flags");
+
+    Constant * zero = ConstantInt::get(Type::getInt32Ty(ctx), 0, false);
+    Constant * indices[] = { zero, zero };
+    StructType * versionTableType = StructType::get(ptrType, PointerType::getUnqual(i8PtrType), PointerType::getUnqual(i8PtrType), NULL);
+    std::vector<Constant *> fields;
+    fields.push_back(ConstantInt::get(ptrType, versionedFunctions.size(), false));
+    fields.push_back(ConstantExpr::getInBoundsGetElementPtr(namesTable, indices));
+    fields.push_back(ConstantExpr::getInBoundsGetElementPtr(flagsTable, indices));
+    GlobalVariable * versionTable = new GlobalVariable(M, versionTableType, true, GlobalValue::InternalLinkage,
+        ConstantStruct::get(versionTableType, fields), "__heaptoss_versions");
+
+    Constant * heaptoss_register_versions = M.getOrInsertFunction("heaptoss_register_versions", Type::getVoidTy(ctx), i8PtrType, NULL);
+    Function * ctor = Function::Create(FunctionType::get(Type::getVoidTy(ctx), false),
+        GlobalValue::InternalLinkage, "heaptoss.versions_ctor", &M);
+    BasicBlock * entry = BasicBlock::Create(ctx, "", ctor);
+    CallInst::Create(heaptoss_register_versions, ConstantExpr::getBitCast(versionTable, i8PtrType), "", entry);
+    ReturnInst::Create(ctx, entry);
+    appendToGlobalCtors(M, ctor, 0);
+  }
+
+  /**
+   * Checks if f may capture its argument arg: keep a copy of it anywhere that outlives the
+   * call, or return it. Pointers derived from arg by casts, GEPs, PHIs and selects are
+   * followed. Passing it to a call only captures it if the callee's parameter is not
+   * nocapture, and noCapture holds the parameters we are currently assuming to be nocapture.
+   */
+  bool mayCapture(Argument * arg, set<Argument *> & noCapture) {
+    std::vector<Value *> worklist;
+    set<Value *> visited;
+    worklist.push_back(arg);
+    visited.insert(arg);
+
+    while (!worklist.empty()) {
+      Value * ptr = worklist.back();
+      worklist.pop_back();
+
+      for (Value::use_iterator u = ptr->use_begin(); u != ptr->use_end(); u++) {
+        Instruction * use = dyn_cast<Instruction>(*u);
+        if (use == NULL) return true;
+
+        if (isa<CastInst>(use) || isa<PHINode>(use) || isa<SelectInst>(use)
+            || (isa<GetElementPtrInst>(use) && use->getOperand(0) == ptr)) {
+          //ptrtoint loses track of it.
+          if (isa<PtrToIntInst>(use)) return true;
+          if (visited.insert(use).second) worklist.push_back(use);
+        }
+        else if (isa<LoadInst>(use) || isa<ICmpInst>(use) || isa<DbgInfoIntrinsic>(use)) {
+          continue;
+        }
+        else if (StoreInst * store = dyn_cast<StoreInst>(use)) {
+          if (store->getValueOperand() == ptr) return true;
+        }
+        else if (isa<CallInst>(use) || isa<InvokeInst>(use)) {
+          CallSite cs(use);
+          for (unsigned a = 0; a < cs.arg_size(); a++) {
+            if (cs.getArgument(a) != ptr || cs.paramHasAttr(a + 1, Attribute::NoCapture)) continue;
+
+            //Only trust what we know of the callee's body.
+            Function * callee = cs.getCalledFunction();
+            if (callee == NULL || callee->isDeclaration() || callee->mayBeOverridden()
+                || a >= callee->arg_size()) {
+              return true;
+            }
+            Function::arg_iterator param = callee->arg_begin();
+            std::advance(param, a);
+            if (noCapture.count(param) == 0) return true;
+          }
+          if (cs.getCalledValue() == ptr) return true;
+        }
+        else {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Marks the pointer arguments that functions never capture as nocapture. SCCs come in
+   * bottom-up order, so callees outside of an SCC are already done. Within an SCC, every
+   * argument starts out as nocapture, and arguments are dropped until nothing changes.
+   */
+  void inferNoCapture(std::vector<std::vector<Function *> > & sccs) {
+    set<Argument *> noCapture;
+    unsigned inferred = 0;
+
+    for (unsigned s = 0; s < sccs.size(); s++) {
+      std::vector<Argument *> candidates;
+      for (unsigned f = 0; f < sccs[s].size(); f++) {
+        Function * fcn = sccs[s][f];
+        if (fcn->mayBeOverridden()) continue;
+
+        for (Function::arg_iterator arg = fcn->arg_begin(); arg != fcn->arg_end(); arg++) {
+          if (arg->getType()->isPointerTy() && !arg->hasNoCaptureAttr()) {
+            candidates.push_back(arg);
+            noCapture.insert(arg);
+          }
+        }
+      }
+
+      bool changed = true;
+      while (changed) {
+        changed = false;
+        for (unsigned c = 0; c < candidates.size(); c++) {
+          if (noCapture.count(candidates[c]) != 0 && mayCapture(candidates[c], noCapture)) {
+            noCapture.erase(candidates[c]);
+            changed = true;
+          }
+        }
+      }
+
+      for (unsigned c = 0; c < candidates.size(); c++) {
+        if (noCapture.count(candidates[c]) == 0) continue;
+        candidates[c]->getParent()->setDoesNotCapture(candidates[c]->getArgNo() + 1);
+        inferred++;
+      }
+    }
+
+    errs() << "Inferred " << inferred << " nocapture arguments over the whole program.\n";
+  }
+
+  /**
+   * Fills in nonReentrantFunctions from the annotations clang leaves in
+   * llvm.global.annotations, which is an array of { i8* value, i8* annotation, i8* file, i32 line }.
+   */
+  void findNonReentrantFunctions(Module & M) {
+    GlobalVariable * annotations = M.getGlobalVariable("llvm.global.annotations");
+    if (annotations == NULL || !annotations->hasInitializer()) return;
+
+    ConstantArray * entries = dyn_cast<ConstantArray>(annotations->getInitializer());
+    if (entries == NULL) return;
+
+    for (unsigned e = 0; e < entries->getNumOperands(); e++) {
+      ConstantStruct * entry = dyn_cast<ConstantStruct>(entries->getOperand(e));
+      if (entry == NULL || entry->getNumOperands() < 2) continue;
+
+      Function * f = dyn_cast<Function>(entry->getOperand(0)->stripPointerCasts());
+      GlobalVariable * annotation = dyn_cast<GlobalVariable>(entry->getOperand(1)->stripPointerCasts());
+      if (f == NULL || annotation == NULL || !annotation->hasInitializer()) continue;
+
+      ConstantDataArray * text = dyn_cast<ConstantDataArray>(annotation->getInitializer());
+      if (text != NULL && text->isCString() && text->getAsCString() == "heaptoss_nonreentrant") {
+        nonReentrantFunctions.insert(f);
+      }
+    }
+  }
+
   /**
    * Iterates over every basic block in the module, and tosses stack variables into
    * the heap if needed.
@@ -487,25 +1978,88 @@ struct HeapTossPass: public ModulePass {
       ptrWidth = 32;
     }
 
-    stats = new HeapTossStats(M, ptrType, GATHER_STATS);
+    stats = new HeapTossStats(M, ptrType, GATHER_STATS, CONTEXT_PROFILE, WHOLE_PROGRAM);
+    targetData = getAnalysisIfAvailable<TargetData>();
 
-    Module::FunctionListType & functions = M.getFunctionList();
-    Function * mainFunc = NULL;
+    if (ALLOCATOR_ABI) {
+      LLVMContext & ctx = M.getContext();
+      Type * i8PtrType = Type::getInt8PtrTy(ctx);
+      Constant * heaptoss_alloc_c = M.getOrInsertFunction("heaptoss_alloc", i8PtrType, ptrType, ptrType, NULL);
+      Constant * heaptoss_free_c = M.getOrInsertFunction("heaptoss_free", Type::getVoidTy(ctx), i8PtrType, ptrType, ptrType, NULL);
 
-    for (iplist<Function>::iterator f_iter = functions.begin(); f_iter != functions.end(); f_iter++) {
-      Function & f = *f_iter;
-      currentFunction = &f;
+      if (!isa<Function>(heaptoss_alloc_c) || !isa<Function>(heaptoss_free_c)) {
+        errs() << "ERROR: heaptoss_alloc and heaptoss_free are already declared with another type.\n";
+        exit(1);
+      }
+      heaptossAlloc = dyn_cast<Function>(heaptoss_alloc_c);
+      heaptossFree = dyn_cast<Function>(heaptoss_free_c);
+
+      //Lets alias analysis treat each frame as its own object, like a malloc'd one.
+      if (ANNOTATE_FRAMES) {
+        heaptossAlloc->setDoesNotAlias(0);
+        heaptossAlloc->setDoesNotThrow();
+        heaptossFree->setDoesNotCapture(1);
+        heaptossFree->setDoesNotThrow();
+      }
+    }
+    escapeAnalysis = new HeapTossEscapeAnalysis(TOSS_ALL, WHOLE_PROGRAM);
+    originalVersion = NULL;
+    untossedVersion = NULL;
+
+    if (STATIC_FRAMES) {
+      findNonReentrantFunctions(M);
+
+      if (CHECK_REENTRANCY) {
+        Type * i8PtrType = Type::getInt8PtrTy(M.getContext());
+        Constant * heaptoss_frame_enter_c = M.getOrInsertFunction("heaptoss_frame_enter", Type::getVoidTy(M.getContext()), i8PtrType, i8PtrType, NULL);
+        if (!isa<Function>(heaptoss_frame_enter_c)) {
+          errs() << "ERROR: heaptoss_frame_enter is already declared with another type.\n";
+          exit(1);
+        }
+        heaptossFrameEnter = dyn_cast<Function>(heaptoss_frame_enter_c);
+      }
+    }
+    remarks = new HeapTossRemarks(REMARKS_FILE, REMARKS_PROFILE, targetData);
+
+    //Visit callees before their callers, so that we know the frames of the callees when we
+    //toss the callers.
+    std::vector<Function *> functions;
+    std::vector<std::vector<Function *> > sccs;
+    CallGraph & callGraph = getAnalysis<CallGraph>();
+    for (scc_iterator<CallGraph*> scc = scc_begin(&callGraph); !scc.isAtEnd(); ++scc) {
+      std::vector<CallGraphNode*> & nodes = *scc;
+      sccs.push_back(std::vector<Function *>());
+      for (unsigned n = 0; n < nodes.size(); n++) {
+        Function * f = nodes[n]->getFunction();
+
+        //We only want functions with a body.
+        if (f == NULL || f->isDeclaration()) continue;
+
+        functions.push_back(f);
+        sccs.back().push_back(f);
+        if (scc.hasLoop()) recursiveFunctions.insert(f);
+      }
 
-      //We only want functions with a body.
-      if(f.isDeclaration()) {
-        continue;
+      if (SINGLE_THREADED && reachesUnknownCode(callGraph, sccs.back())) {
+        reachUnknownCode.insert(sccs.back().begin(), sccs.back().end());
       }
+    }
+
+    if (WHOLE_PROGRAM) inferNoCapture(sccs);
+
+    for (unsigned f_index = 0; f_index < functions.size(); f_index++) {
+      Function & f = *functions[f_index];
+      currentFunction = &f;
+
+      originalVersion = NULL;
+      if (MULTIVERSION && !f.isVarArg()) originalVersion = cloneUntossedVersion(&f);
 
       stats->addFunction(&f);
 
-      if (f.getName().compare("main") == 0) {
-        mainFunc = &f;
-      }
+      //Demoted mallocs become ordinary stack slots, which we then decide whether to toss.
+      if (DEMOTE_MALLOCS) demoteMallocs(&f);
+
+      if (SPLIT_AGGREGATES && !TOSS_ALL && !TOSS_NONE && targetData != NULL) splitAggregates(&f);
 
       for (iplist<BasicBlock>::iterator b_iter = f.begin(); b_iter != f.end(); b_iter++)
       {
@@ -513,19 +2067,38 @@ struct HeapTossPass: public ModulePass {
         processBlock(b);
       }
 
+      escapeAnalysis->analyze(f);
+
       //Toss all of the variables in toToss.
       if (!TOSS_NONE) tossAll(&f);
 
+      if (PRESERVE_TAIL_CALLS) preserveTailCalls(&f);
+
+      for (unsigned mi = 0; mi < memIntrinsics.size(); mi++) {
+        fixMemIntrinsicAlignment(memIntrinsics[mi]);
+      }
+
+      if (untossedVersion != NULL) insertVersionDispatch(&f, untossedVersion);
+      else if (originalVersion != NULL) originalVersion->eraseFromParent();
+
       //Clear global state.
+      untossedVersion = NULL;
       toTossStatic.clear();
       toTossDynamic.clear();
       terminatorInsts.clear();
+      memIntrinsics.clear();
+      frameReleases.clear();
+      tossedFrameObjects.clear();
     }
 
-    stats->insertInitialization(mainFunc);
+    stats->insertRegistration(M);
+    insertVersionRegistration(M);
     stats->outputStats(M);
+    remarks->output();
 
     delete stats;
+    delete escapeAnalysis;
+    delete remarks;
     return true;
   }
 
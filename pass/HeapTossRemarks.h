@@ -0,0 +1,239 @@
+/*
+ * HeapTossRemarks.h
+ *
+ * Explains why each tossed stack slot was tossed, in a YAML file.
+ */
+#ifndef HEAPTOSSREMARKS_H_
+#define HEAPTOSSREMARKS_H_
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "llvm/Function.h"
+#include "llvm/Instructions.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Analysis/DebugInfo.h"
+#include "llvm/Target/TargetData.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace std;
+using namespace llvm;
+
+/**
+ * Collects a remark for every tossed stack slot, and writes them to a YAML file sorted by
+ * estimated cost, most expensive first.
+ *
+ * A remark names the function, the slot, the source variable and line it came from (if the
+ * module has debug info), the use that lets it escape and what kind of use that is, the
+ * slot's size, and how many times the function ran according to a runtime profile.
+ *
+ * The cost of a slot is an estimate of the bytes it puts on the heap: its size times the
+ * function's profiled execution count, or just its size if the function was not profiled.
+ */
+class HeapTossRemarks {
+private:
+  struct Remark {
+    string function;
+    string slot;
+    //Source variable and the line it was declared on, from its dbg.declare.
+    string variable;
+    string file;
+    unsigned line;
+    //0 if we could not tell.
+    uint64_t size;
+    //-1 if the function was not profiled.
+    long long calls;
+    //The use that lets the slot escape, and its category. Empty if every slot is tossed.
+    string escapeCategory;
+    string escapeInstruction;
+    string escapeFile;
+    unsigned escapeLine;
+
+    uint64_t getCost() const {
+      return calls < 0 ? size : size * (uint64_t) calls;
+    }
+
+    bool operator<(const Remark & other) const {
+      if (getCost() != other.getCost()) return getCost() > other.getCost();
+      if (function != other.function) return function < other.function;
+      return slot < other.slot;
+    }
+  };
+
+  std::vector<Remark> remarks;
+  string filename;
+  //Execution count of each function, by name, from the profile.
+  map<string, long long> callCounts;
+  //May be NULL, in which case sizes are unknown.
+  TargetData * targetData;
+
+  /**
+   * Reads the execution counts from a run statistics file written by libHeapToss
+   * (htstats_run_N.csv). Counts of functions with the same name in different modules are
+   * added up.
+   */
+  void readProfile(const string & profileFilename) {
+    ifstream profile(profileFilename.c_str());
+    if (!profile) {
+      errs() << "WARNING: Could not read the profile " << profileFilename << ". Call counts will be unknown.\n";
+      return;
+    }
+
+    //Module,ID,Function Name,Execution Count,...
+    string line;
+    getline(profile, line);
+    while (getline(profile, line)) {
+      std::vector<string> columns;
+      stringstream lineStream(line);
+      string column;
+      while (getline(lineStream, column, ',')) columns.push_back(column);
+      if (columns.size() < 4) continue;
+
+      callCounts[columns[2]] += atoll(columns[3].c_str());
+    }
+  }
+
+  /**
+   * Returns the category of a use that lets a stack slot escape.
+   */
+  static const char * getEscapeCategory(Instruction * use) {
+    if (isa<CallInst>(use) || isa<InvokeInst>(use)) return "call-argument";
+    if (isa<StoreInst>(use)) return "store";
+    if (isa<ReturnInst>(use)) return "return";
+    if (isa<CastInst>(use)) return "cast";
+    if (isa<PHINode>(use) || isa<SelectInst>(use)) return "merge";
+    return "other";
+  }
+
+  /**
+   * Fills in file and line with the source location of inst, if it has one.
+   */
+  static void getLocation(Instruction * inst, string & file, unsigned & line) {
+    const DebugLoc & loc = inst->getDebugLoc();
+    line = loc.getLine();
+    if (loc.isUnknown()) return;
+
+    DIScope scope(loc.getScope(inst->getContext()));
+    file = scope.getFilename();
+  }
+
+  static string quote(const string & str) {
+    string quoted = "\"";
+    for (unsigned i = 0; i < str.size(); i++) {
+      if (str[i] == '"' || str[i] == '\\') quoted += '\\';
+      quoted += str[i];
+    }
+    return quoted + "\"";
+  }
+
+  /**
+   * Returns the textual IR of inst, without its leading indentation.
+   */
+  static string print(Instruction * inst) {
+    string text;
+    raw_string_ostream textStream(text);
+    inst->print(textStream);
+    textStream.flush();
+    size_t start = text.find_first_not_of(' ');
+    return start == string::npos ? text : text.substr(start);
+  }
+
+public:
+  /**
+   * Does nothing unless filename is not empty. profileFilename may be empty.
+   */
+  HeapTossRemarks(const string & filename, const string & profileFilename, TargetData * targetData)
+      : filename(filename), targetData(targetData) {
+    if (isEnabled() && !profileFilename.empty()) readProfile(profileFilename);
+  }
+
+  bool isEnabled() {
+    return !filename.empty();
+  }
+
+  /**
+   * Records a remark for a slot that is about to be tossed. escapingUse is the use that lets
+   * it escape, or NULL if every slot is tossed. Must be called before the slot is replaced.
+   */
+  void addTossedSlot(AllocaInst * slot, Instruction * escapingUse) {
+    if (!isEnabled()) return;
+
+    Function * f = slot->getParent()->getParent();
+    Remark remark;
+    remark.function = f->getName();
+    remark.slot = slot->getName();
+    remark.line = 0;
+    remark.escapeLine = 0;
+
+    if (DbgDeclareInst * declare = FindAllocaDbgDeclare(slot)) {
+      DIVariable variable(declare->getVariable());
+      remark.variable = variable.getName();
+      remark.line = variable.getLineNumber();
+      remark.file = variable.getContext().getFilename();
+    }
+
+    remark.size = 0;
+    ConstantInt * arraySize = dyn_cast<ConstantInt>(slot->getArraySize());
+    if (targetData != NULL && arraySize != NULL) {
+      remark.size = targetData->getTypeAllocSize(slot->getAllocatedType()) * arraySize->getZExtValue();
+    }
+
+    map<string, long long>::iterator calls = callCounts.find(remark.function);
+    remark.calls = calls == callCounts.end() ? -1 : calls->second;
+
+    if (escapingUse != NULL) {
+      remark.escapeCategory = getEscapeCategory(escapingUse);
+      remark.escapeInstruction = print(escapingUse);
+      getLocation(escapingUse, remark.escapeFile, remark.escapeLine);
+    }
+
+    remarks.push_back(remark);
+  }
+
+  void output() {
+    if (!isEnabled()) return;
+
+    errs() << "Outputting toss remarks to " << filename << "...\n";
+
+    ofstream outFile;
+    outFile.open(filename.c_str(), ios::out);
+
+    std::sort(remarks.begin(), remarks.end());
+
+    outFile << "--- !HeapTossRemarks\n";
+    outFile << "remarks:\n";
+    for (unsigned r = 0; r < remarks.size(); r++) {
+      Remark & remark = remarks[r];
+      outFile << "  - function: " << quote(remark.function) << "\n";
+      outFile << "    slot: " << quote(remark.slot) << "\n";
+      if (!remark.variable.empty()) {
+        outFile << "    variable: " << quote(remark.variable) << "\n";
+        outFile << "    location: { file: " << quote(remark.file) << ", line: " << remark.line << " }\n";
+      }
+      if (remark.size != 0) outFile << "    size: " << remark.size << "\n";
+      if (remark.calls >= 0) outFile << "    calls: " << remark.calls << "\n";
+      outFile << "    cost: " << remark.getCost() << "\n";
+
+      if (remark.escapeCategory.empty()) {
+        outFile << "    escape: { category: toss-all }\n";
+        continue;
+      }
+      outFile << "    escape:\n";
+      outFile << "      category: " << remark.escapeCategory << "\n";
+      outFile << "      instruction: " << quote(remark.escapeInstruction) << "\n";
+      if (remark.escapeLine != 0) {
+        outFile << "      location: { file: " << quote(remark.escapeFile) << ", line: " << remark.escapeLine << " }\n";
+      }
+    }
+    outFile << "...\n";
+
+    outFile.close();
+  }
+};
+
+#endif /* HEAPTOSSREMARKS_H_ */
@@ -28,49 +28,118 @@
 #include "llvm/PassManager.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/IntrinsicInst.h"
+#include "llvm/Support/CallSite.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace std;
 using namespace llvm;
 
+//Number of call sites kept in the thread-local shadow context. Must be a power of two, and
+//must match HT_CONTEXT_DEPTH in libHeapToss.cpp.
+#define HT_CONTEXT_DEPTH 8
+
+//Which version of a MemIntrinsic is running. Must match the runtime's path IDs.
+enum MemIntrinsicPath {
+  //The MemIntrinsic was not versioned.
+  MI_PATH_UNVERSIONED = 0,
+  //The operands turned out to be aligned, and we kept the original alignment.
+  MI_PATH_ALIGNED = 1,
+  //The conservative version, with an alignment of 1.
+  MI_PATH_UNALIGNED = 2
+};
+
 /**
  * Adds instrumentation to the program for stat collection, and collect static compile-time stats.
+ *
+ * Function IDs are local to the module. Every instrumented module describes itself with a
+ * module table (see HeapTossModule in libHeapToss.cpp), which a module constructor registers
+ * with the runtime. Instrumentation calls pass the module table along with the function ID,
+ * so modules from different translation units, shared libraries and dlopen'd plugins never
+ * share an ID space.
  */
 class HeapTossStats {
 private:
   map<Function*, unsigned> fcnIds;
+  //Functions in ID order. Used to build the module table.
+  std::vector<Function*> fcnsById;
+  //Name of each function as an i8* constant.
+  map<Function*, Constant*> fcnNames;
   map<Function*, unsigned> fcnNumTossed;
   map<Function*, unsigned> fcnStackSlots;
   map<Function*, unsigned> fcnDynamicSlots;
   map<Function*, unsigned> fcnDynamicNumTossed;
+  map<Function*, unsigned> fcnCoalescedCalls;
+  map<Function*, unsigned> fcnDemotedMallocs;
+  //Bytes of split aggregates that stay on the stack.
+  map<Function*, uint64_t> fcnSplitBytes;
+  //Where the cost model put each function's tossed slots, and its estimated cost per call
+  //against batching them all.
+  map<Function*, unsigned> fcnBatchedSlots;
+  map<Function*, unsigned> fcnSeparateSlots;
+  map<Function*, unsigned> fcnColdSlots;
+  map<Function*, double> fcnPlanCost;
+  map<Function*, double> fcnBatchedCost;
+  //Stack slot in which each call of a function sums up its dynamic tosses. Must match
+  //HeapTossDynTossCall: { size_t bytes, size_t mallocCalls }
+  map<Function*, AllocaInst*> fcnDynTossCalls;
   unsigned nextFcnId;
   Function * heaptoss_dynamic_toss;
+  Function * heaptoss_dynamic_toss_done;
   Function * heaptoss_malloc_size;
   Function * heaptoss_fcn_run;
   Function * heaptoss_fcn_ret;
   Function * heaptoss_memintrinsic_execution;
-  Function * heaptoss_initialize;
+  Function * heaptoss_register_module;
+  Function * heaptoss_context_toss;
   bool enabled;
+  //Collect the static stats and write the compile report, even without instrumentation.
+  bool report;
+  //Keep a shadow context at call sites, and report every toss along with it.
+  bool contextProfile;
   Type * ptrType;
+  //Module table that is registered with the runtime. Its layout must match HeapTossModule.
+  //{ size_t numFunctions, const char * moduleName, const char ** fcnNames, void * fcnStats }
+  StructType * moduleTableType;
+  GlobalVariable * moduleTable;
+  //The module table as an i8*, which is what the runtime functions take.
+  Constant * moduleTablePtr;
+  //Thread-local shadow context, defined by the runtime.
+  //heaptoss_ctx_stack is a ring of call site descriptors, indexed by heaptoss_ctx_depth.
+  GlobalVariable * heaptoss_ctx_stack;
+  GlobalVariable * heaptoss_ctx_depth;
+  //Type of the call site descriptors. Must match HeapTossCallSite.
+  //{ const char * callerName, unsigned line }
+  StructType * callSiteType;
+  Module * module;
 
 public:
-  HeapTossStats(Module &M, Type* ptrType, bool enabled) {
+  HeapTossStats(Module &M, Type* ptrType, bool enabled, bool contextProfile, bool report) {
     this->ptrType = ptrType;
     this->enabled = enabled;
+    this->report = enabled || report;
+    this->contextProfile = enabled && contextProfile;
     this->nextFcnId = 0;
+    this->module = &M;
     //Grab the library functions.
     //TODO: If the # of functions grows significantly larger, may want to make a helper function.
     if (enabled)
     {
-      Constant * heaptoss_fcn_run_c = M.getOrInsertFunction("heaptoss_fcn_run", FunctionType::getVoidTy(M.getContext()), ptrType, NULL);
-      Constant * heaptoss_fcn_ret_c = M.getOrInsertFunction("heaptoss_fcn_ret", FunctionType::getVoidTy(M.getContext()), ptrType, NULL);
-      Constant * heaptoss_malloc_size_c = M.getOrInsertFunction("heaptoss_malloc_size", FunctionType::getVoidTy(M.getContext()), ptrType, ptrType, NULL);
-      Constant * heaptoss_dynamic_toss_c = M.getOrInsertFunction("heaptoss_dynamic_toss", FunctionType::getVoidTy(M.getContext()), ptrType, ptrType, NULL);
-      Constant * heaptoss_memintrinsic_execution_c = M.getOrInsertFunction("heaptoss_memintrinsic_execution", FunctionType::getVoidTy(M.getContext()), ptrType, ptrType, NULL);
-      Constant * heaptoss_initialize_c = M.getOrInsertFunction("heaptoss_initialize", FunctionType::getVoidTy(M.getContext()), ptrType, NULL);
+      LLVMContext & ctx = M.getContext();
+      Type * i8PtrType = Type::getInt8PtrTy(ctx);
+
+      Constant * heaptoss_fcn_run_c = M.getOrInsertFunction("heaptoss_fcn_run", FunctionType::getVoidTy(ctx), i8PtrType, ptrType, NULL);
+      Constant * heaptoss_fcn_ret_c = M.getOrInsertFunction("heaptoss_fcn_ret", FunctionType::getVoidTy(ctx), i8PtrType, ptrType, NULL);
+      Constant * heaptoss_malloc_size_c = M.getOrInsertFunction("heaptoss_malloc_size", FunctionType::getVoidTy(ctx), i8PtrType, ptrType, ptrType, NULL);
+      Constant * heaptoss_dynamic_toss_c = M.getOrInsertFunction("heaptoss_dynamic_toss", FunctionType::getVoidTy(ctx), i8PtrType, ptrType, ptrType, i8PtrType, NULL);
+      Constant * heaptoss_dynamic_toss_done_c = M.getOrInsertFunction("heaptoss_dynamic_toss_done", FunctionType::getVoidTy(ctx), i8PtrType, ptrType, i8PtrType, NULL);
+      Constant * heaptoss_memintrinsic_execution_c = M.getOrInsertFunction("heaptoss_memintrinsic_execution", FunctionType::getVoidTy(ctx), ptrType, ptrType, ptrType, NULL);
+      Constant * heaptoss_register_module_c = M.getOrInsertFunction("heaptoss_register_module", FunctionType::getVoidTy(ctx), i8PtrType, NULL);
 
       if (!isa<Function>(heaptoss_fcn_run_c) || !isa<Function>(heaptoss_fcn_ret_c)
           || !isa<Function>(heaptoss_malloc_size_c) || !isa<Function>(heaptoss_dynamic_toss_c)
-          || !isa<Function>(heaptoss_memintrinsic_execution) || !isa<Function>(heaptoss_initialize))
+          || !isa<Function>(heaptoss_dynamic_toss_done_c)
+          || !isa<Function>(heaptoss_memintrinsic_execution_c) || !isa<Function>(heaptoss_register_module_c))
       {
         errs() << "ERROR: Need to link heaptoss runtime library in order to enable dynamic statistic collecting.\n";
         exit(1);
@@ -78,13 +147,37 @@ public:
       heaptoss_fcn_run = dyn_cast<Function>(heaptoss_fcn_run_c);
       heaptoss_malloc_size = dyn_cast<Function>(heaptoss_malloc_size_c);
       heaptoss_dynamic_toss = dyn_cast<Function>(heaptoss_dynamic_toss_c);
+      heaptoss_dynamic_toss_done = dyn_cast<Function>(heaptoss_dynamic_toss_done_c);
       heaptoss_memintrinsic_execution = dyn_cast<Function>(heaptoss_memintrinsic_execution_c);
       heaptoss_fcn_ret = dyn_cast<Function>(heaptoss_fcn_ret_c);
-      heaptoss_initialize = dyn_cast<Function>(heaptoss_initialize_c);
+      heaptoss_register_module = dyn_cast<Function>(heaptoss_register_module_c);
+
+      //The module table is filled in by insertRegistration once we know every function in
+      //the module. Until then it is zeroed.
+      moduleTableType = StructType::get(ptrType, i8PtrType, PointerType::getUnqual(i8PtrType), i8PtrType, NULL);
+      moduleTable = new GlobalVariable(M, moduleTableType, false, GlobalValue::InternalLinkage,
+          Constant::getNullValue(moduleTableType), "__heaptoss_module");
+      moduleTablePtr = ConstantExpr::getBitCast(moduleTable, i8PtrType);
+
+      if (this->contextProfile) {
+        Constant * heaptoss_context_toss_c = M.getOrInsertFunction("heaptoss_context_toss", FunctionType::getVoidTy(ctx), i8PtrType, ptrType, ptrType, NULL);
+        if (!isa<Function>(heaptoss_context_toss_c)) {
+          errs() << "ERROR: Need to link heaptoss runtime library in order to enable context profiling.\n";
+          exit(1);
+        }
+        heaptoss_context_toss = dyn_cast<Function>(heaptoss_context_toss_c);
+
+        //External declarations of the runtime's thread-local variables.
+        heaptoss_ctx_stack = new GlobalVariable(M, ArrayType::get(i8PtrType, HT_CONTEXT_DEPTH), false,
+            GlobalValue::ExternalLinkage, NULL, "heaptoss_ctx_stack", NULL, true);
+        heaptoss_ctx_depth = new GlobalVariable(M, ptrType, false,
+            GlobalValue::ExternalLinkage, NULL, "heaptoss_ctx_depth", NULL, true);
+        callSiteType = StructType::get(i8PtrType, Type::getInt32Ty(ctx), NULL);
+      }
     }
   }
 
-  void addMemIntrinsic(MemIntrinsic * memIntrinsic) {
+  void addMemIntrinsic(MemIntrinsic * memIntrinsic, MemIntrinsicPath path) {
     if (!enabled) return;
 
     unsigned miId;
@@ -104,19 +197,31 @@ public:
       exit(1);
     }
 
+    Value * length = memIntrinsic->getLength();
+    if (length->getType() != ptrType) {
+      length = BitCastInst::CreateIntegerCast(length, ptrType, false, "", memIntrinsic);
+    }
+
     std::vector<Value*> htMiArgs;
     htMiArgs.push_back(ConstantInt::get(ptrType, miId, false));
-    htMiArgs.push_back(memIntrinsic->getLength());
+    htMiArgs.push_back(length);
+    htMiArgs.push_back(ConstantInt::get(ptrType, path, false));
     CallInst::Create(heaptoss_memintrinsic_execution, htMiArgs, "", memIntrinsic);
   }
 
   void addFunction(Function* f) {
-    if (!enabled) return;
+    if (!report) return;
 
     fcnNumTossed[f] = 0;
     fcnStackSlots[f] = 0;
     fcnIds[f] = nextFcnId;
+    fcnsById.push_back(f);
     nextFcnId++;
+    if (!enabled) return;
+
+    fcnNames[f] = getStringPtr(*module, f->getName(), "__heaptoss_fcn_name");
+
+    addCallSiteContexts(f);
 
     //Insert call to heaptoss_fcn_run so we can record the number of times
     //this function is run.
@@ -124,24 +229,156 @@ public:
     Instruction * firstInst = first->getFirstNonPHI();
     std::vector<Value*> htFcnRunArgs;
     Constant * fcnIdConst = ConstantInt::get(ptrType, fcnIds[f], false);
+    htFcnRunArgs.push_back(moduleTablePtr);
     htFcnRunArgs.push_back(fcnIdConst);
     CallInst::Create(heaptoss_fcn_run, htFcnRunArgs, "", firstInst);
   }
 
+  /**
+   * Instruments untossed, the untossed version of f, which f calls from its dispatch block
+   * (call) and then returns (ret). The call counts as a run of f, just like a run of its
+   * tossed body, and the call sites in untossed keep the shadow context as calls from f.
+   */
+  void addUntossedVersion(Function* f, Function* untossed, Instruction* call, Instruction* ret) {
+    if (!enabled) return;
+
+    addCallSiteContexts(untossed, fcnNames[f]);
+
+    Value * htFcnArgs[] = { moduleTablePtr, ConstantInt::get(ptrType, fcnIds[f], false) };
+    CallInst::Create(heaptoss_fcn_run, htFcnArgs, "", call);
+    CallInst::Create(heaptoss_fcn_ret, htFcnArgs, "", ret);
+  }
+
+  /**
+   * Maintains the shadow context around every call site in f.
+   *
+   * The context depth is loaded once on entry. It is the same at every call site, as callees
+   * restore it before returning. Before each call, we store the call site's descriptor at that
+   * depth and bump the depth. After each call (and on both edges of an invoke), we restore it.
+   * If an exception unwinds through f, the nearest landing pad above it restores the depth.
+   */
+  void addCallSiteContexts(Function* f) {
+    addCallSiteContexts(f, fcnNames[f]);
+  }
+
+  /**
+   * Same as above, but the call sites are reported as calls from callerName.
+   */
+  void addCallSiteContexts(Function* f, Constant* callerName) {
+    if (!contextProfile) return;
+
+    std::vector<Instruction*> callSites;
+    for (Function::iterator b = f->begin(); b != f->end(); b++) {
+      for (BasicBlock::iterator i = b->begin(); i != b->end(); i++) {
+        if (!isa<CallInst>(i) && !isa<InvokeInst>(i)) continue;
+
+        //Intrinsics and our own runtime hooks are not interesting.
+        CallSite cs(i);
+        Function * callee = cs.getCalledFunction();
+        if (callee != NULL && (callee->isIntrinsic() || callee->getName().startswith("heaptoss_"))) continue;
+
+        callSites.push_back(i);
+      }
+    }
+
+    if (callSites.size() == 0) return;
+
+    LLVMContext & ctx = f->getContext();
+    Instruction * firstInst = f->getEntryBlock().getFirstNonPHI();
+    LoadInst * depth = new LoadInst(heaptoss_ctx_depth, "ht.ctx.depth", firstInst);
+    Value * ringIndex = BinaryOperator::CreateAnd(depth, ConstantInt::get(ptrType, HT_CONTEXT_DEPTH - 1, false), "", firstInst);
+    Value * indices[] = { ConstantInt::get(ptrType, 0, false), ringIndex };
+    Instruction * slot = GetElementPtrInst::Create(heaptoss_ctx_stack, indices, "ht.ctx.slot", firstInst);
+    Value * calleeDepth = BinaryOperator::CreateAdd(depth, ConstantInt::get(ptrType, 1, false), "", firstInst);
+
+    set<BasicBlock*> restoredBlocks;
+    for (unsigned c = 0; c < callSites.size(); c++) {
+      Instruction * call = callSites[c];
+
+      //Descriptor of this call site.
+      unsigned line = call->getDebugLoc().getLine();
+      Constant * fields[] = { callerName, ConstantInt::get(Type::getInt32Ty(ctx), line, false) };
+      Constant * descriptorConst = ConstantStruct::get(callSiteType, fields);
+      GlobalVariable * descriptor = new GlobalVariable(*module, callSiteType, true,
+          GlobalValue::PrivateLinkage, descriptorConst, "__heaptoss_call_site");
+
+      new StoreInst(ConstantExpr::getBitCast(descriptor, Type::getInt8PtrTy(ctx)), slot, call);
+      new StoreInst(calleeDepth, heaptoss_ctx_depth, call);
+
+      if (isa<InvokeInst>(call)) {
+        InvokeInst * invoke = dyn_cast<InvokeInst>(call);
+        BasicBlock * dests[] = { invoke->getNormalDest(), invoke->getUnwindDest() };
+        for (unsigned d = 0; d < 2; d++) {
+          if (restoredBlocks.insert(dests[d]).second) {
+            new StoreInst(depth, heaptoss_ctx_depth, dests[d]->getFirstInsertionPt());
+          }
+        }
+      }
+      else {
+        BasicBlock::iterator next = call;
+        next++;
+        new StoreInst(depth, heaptoss_ctx_depth, next);
+      }
+    }
+  }
+
+  /**
+   * Reports a toss of the given size to the runtime's context profile.
+   */
+  void addContextToss(Function* f, Value* size, Instruction* insertBefore) {
+    if (!contextProfile) return;
+
+    std::vector<Value*> htContextTossArgs;
+    htContextTossArgs.push_back(moduleTablePtr);
+    htContextTossArgs.push_back(ConstantInt::get(ptrType, fcnIds[f], false));
+    htContextTossArgs.push_back(size);
+    CallInst::Create(heaptoss_context_toss, htContextTossArgs, "", insertBefore);
+  }
+
   void addTerminator(Function* f, Instruction* terminator) {
     if (!enabled) return;
 
     std::vector<Value*> htFcnRetArgs;
     Constant * fcnIdConst = ConstantInt::get(ptrType, fcnIds[f], false);
+    htFcnRetArgs.push_back(moduleTablePtr);
     htFcnRetArgs.push_back(fcnIdConst);
     CallInst::Create(heaptoss_fcn_ret, htFcnRetArgs, "", terminator);
   }
 
-  void addDynamicToss(Function* f, Value* size, Instruction* tossInstruction) {
+  /**
+   * Returns the stack slot in which the current call of f sums up its dynamic tosses, as an
+   * i8*. The first time, creates it, zeroes it on entry and hands it to the runtime before
+   * every terminator, which adds the call to f's histograms.
+   */
+  Value * getDynTossCall(Function* f, set<Instruction*> & terminators) {
+    Type * i8PtrType = Type::getInt8PtrTy(f->getContext());
+    Instruction * firstInst = f->getEntryBlock().getFirstNonPHI();
+
+    AllocaInst *& call = fcnDynTossCalls[f];
+    if (call == NULL) {
+      Type * callType = ArrayType::get(ptrType, 2);
+      call = new AllocaInst(callType, "ht.dyntoss", firstInst);
+      new StoreInst(Constant::getNullValue(callType), call, firstInst);
+
+      for (set<Instruction*>::iterator t = terminators.begin(); t != terminators.end(); t++) {
+        Value * htDoneArgs[] = { moduleTablePtr, ConstantInt::get(ptrType, fcnIds[f], false),
+            new BitCastInst(call, i8PtrType, "", *t) };
+        CallInst::Create(heaptoss_dynamic_toss_done, htDoneArgs, "", *t);
+      }
+    }
+    return new BitCastInst(call, i8PtrType, "", firstInst);
+  }
+
+  /**
+   * Reports a dynamic toss of the given size, made right before tossInstruction. terminators
+   * are the places where the call of f ends.
+   */
+  void addDynamicToss(Function* f, Value* size, Instruction* tossInstruction, set<Instruction*> & terminators) {
     if (!enabled) return;
 
     //Insert instruction to call dynamic toss thing.
     std::vector<Value*> htDynamicTossArgs;
+    htDynamicTossArgs.push_back(moduleTablePtr);
     htDynamicTossArgs.push_back(ConstantInt::get(ptrType, fcnIds[f], false));
 
     // Sizes are 64-bit. Need to bitcast on 32-bit platforms.
@@ -149,7 +386,9 @@ public:
       size = BitCastInst::CreateIntegerCast(size, ptrType, false, "", tossInstruction);
     }
     htDynamicTossArgs.push_back(size);
+    htDynamicTossArgs.push_back(getDynTossCall(f, terminators));
     CallInst::Create(heaptoss_dynamic_toss, htDynamicTossArgs, "", tossInstruction);
+    addContextToss(f, size, tossInstruction);
   }
 
   void setSize(Function *f, Value* size) {
@@ -158,6 +397,7 @@ public:
     Instruction * insertBefore = f->getEntryBlock().getFirstNonPHI();
 
     std::vector<Value*> htMallocSizeArgs;
+    htMallocSizeArgs.push_back(moduleTablePtr);
     htMallocSizeArgs.push_back(ConstantInt::get(ptrType, fcnIds[f], false));
 
     // Sizes are 64-bit. Need to bitcast on 32-bit platforms.
@@ -166,18 +406,43 @@ public:
     }
     htMallocSizeArgs.push_back(size);
     CallInst::Create(heaptoss_malloc_size, htMallocSizeArgs, "", insertBefore);
+    addContextToss(f, size, insertBefore);
   }
 
   void setStaticStats(Function *f,
       unsigned staticNumTossed, unsigned totalStackSlots,
       unsigned dynamicNumTossed, unsigned totalDynamicSlots) {
-    if (!enabled) return;
+    if (!report) return;
     fcnNumTossed[f] = staticNumTossed;
     fcnStackSlots[f] = totalStackSlots;
     fcnDynamicNumTossed[f] = dynamicNumTossed;
     fcnDynamicSlots[f] = totalDynamicSlots;
   }
 
+  void addCoalescedCall(Function *f) {
+    if (!report) return;
+    fcnCoalescedCalls[f]++;
+  }
+
+  void addDemotedMalloc(Function *f) {
+    if (!report) return;
+    fcnDemotedMallocs[f]++;
+  }
+
+  void addSplitBytes(Function *f, uint64_t bytes) {
+    if (!report) return;
+    fcnSplitBytes[f] += bytes;
+  }
+
+  void setTossPlan(Function *f, unsigned batched, unsigned separate, unsigned cold, double cost, double batchedCost) {
+    if (!report) return;
+    fcnBatchedSlots[f] = batched;
+    fcnSeparateSlots[f] = separate;
+    fcnColdSlots[f] = cold;
+    fcnPlanCost[f] = cost;
+    fcnBatchedCost[f] = batchedCost;
+  }
+
   void alterStaticNumTossed(Function *f, unsigned staticNumTossed) {
     fcnNumTossed[f] = staticNumTossed;
   }
@@ -189,14 +454,17 @@ public:
   }
 
   void outputStats(Module &M) {
-    if (!enabled) return;
+    if (!report) return;
     stringstream outputFileName;
+    //Keeps the string that filename points into alive.
+    string filenameStr;
     const char* filename;
     unsigned i = 0;
     do {
       outputFileName.str(std::string());
       outputFileName << "htstats_compile_" << i++ << ".csv";
-      filename = outputFileName.str().c_str();
+      filenameStr = outputFileName.str();
+      filename = filenameStr.c_str();
     } while (fexists(filename));
 
     errs() << "Outputting static statistics to " << filename  << "...\n";
@@ -204,30 +472,69 @@ public:
     ofstream outFile;
     outFile.open(filename, ios::out);
 
-    outFile << "Function ID,Function Name,Static Tosses,Stack Slots,Dynamic Tosses,Dynamic Slots\n";
+    outFile << "Function ID,Function Name,Static Tosses,Stack Slots,Dynamic Tosses,Dynamic Slots,Coalesced Calls,Demoted Mallocs,Split Bytes Kept,"
+        << "Batched Slots,Separate Slots,Cold Slots,Plan Cost,Batched Cost\n";
     for (map<Function*, unsigned>::iterator i = fcnIds.begin(); i != fcnIds.end(); i++) {
       unsigned fcnId = i->second;
       Function * f = i->first;
       outFile << fcnId << "," << f->getName().data() << "," << fcnNumTossed[f] << ","
           << fcnStackSlots[f] << "," << fcnDynamicNumTossed[f] << ","
-          << fcnDynamicSlots[f] << "\n";
+          << fcnDynamicSlots[f] << "," << fcnCoalescedCalls[f] << "," << fcnDemotedMallocs[f] << ","
+          << fcnSplitBytes[f] << "," << fcnBatchedSlots[f] << "," << fcnSeparateSlots[f] << ","
+          << fcnColdSlots[f] << "," << fcnPlanCost[f] << "," << fcnBatchedCost[f] << "\n";
     }
 
     outFile.close();
   }
 
-  void insertInitialization(Function * main) {
+  /**
+   * Returns a constant i8* pointing at a private, null-terminated copy of str.
+   */
+  Constant * getStringPtr(Module &M, StringRef str, const Twine & name) {
+    Constant * strConst = ConstantDataArray::getString(M.getContext(), str, true);
+    GlobalVariable * strGlobal = new GlobalVariable(M, strConst->getType(), true,
+        GlobalValue::PrivateLinkage, strConst, name);
+    Constant * zero = ConstantInt::get(Type::getInt32Ty(M.getContext()), 0, false);
+    Constant * indices[] = { zero, zero };
+    return ConstantExpr::getInBoundsGetElementPtr(strGlobal, indices);
+  }
+
+  /**
+   * Fills in the module table, and adds a module constructor that registers it with the
+   * runtime. Must be called after every function has been added.
+   */
+  void insertRegistration(Module &M) {
     if (!enabled) return;
 
-    if (main == NULL) {
-      errs() << "ERROR: Main function not found!\n";
-      exit(1);
-    }
+    LLVMContext & ctx = M.getContext();
+    Type * i8PtrType = Type::getInt8PtrTy(ctx);
 
-    Instruction * firstInst = main->getEntryBlock().getFirstNonPHI();
-    std::vector<Value*> htInitArgs;
-    htInitArgs.push_back(ConstantInt::get(ptrType, nextFcnId, false));
-    CallInst::Create(heaptoss_initialize, htInitArgs, "", firstInst);
+    //Table of function names, indexed by function ID.
+    std::vector<Constant*> names;
+    for (unsigned i = 0; i < fcnsById.size(); i++) {
+      names.push_back(fcnNames[fcnsById[i]]);
+    }
+    ArrayType * namesType = ArrayType::get(i8PtrType, names.size());
+    GlobalVariable * namesTable = new GlobalVariable(M, namesType, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(namesType, names), "__heaptoss_fcn_names");
+    Constant * zero = ConstantInt::get(Type::getInt32Ty(ctx), 0, false);
+    Constant * indices[] = { zero, zero };
+
+    std::vector<Constant*> fields;
+    fields.push_back(ConstantInt::get(ptrType, nextFcnId, false));
+    fields.push_back(getStringPtr(M, M.getModuleIdentifier(), "__heaptoss_module_name"));
+    fields.push_back(ConstantExpr::getInBoundsGetElementPtr(namesTable, indices));
+    //Filled in by the runtime.
+    fields.push_back(Constant::getNullValue(i8PtrType));
+    moduleTable->setInitializer(ConstantStruct::get(moduleTableType, fields));
+
+    //Register the table before any other constructor in the module can run instrumented code.
+    Function * ctor = Function::Create(FunctionType::get(Type::getVoidTy(ctx), false),
+        GlobalValue::InternalLinkage, "heaptoss.module_ctor", &M);
+    BasicBlock * entry = BasicBlock::Create(ctx, "", ctor);
+    CallInst::Create(heaptoss_register_module, moduleTablePtr, "", entry);
+    ReturnInst::Create(ctx, entry);
+    appendToGlobalCtors(M, ctor, 0);
   }
 };
 
@@ -0,0 +1,414 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Allocation ABI for tossed memory.
+ *
+ * The pass allocates every tossed frame with heaptoss_alloc(size, align) and releases it
+ * with heaptoss_free(ptr, size, align). The backend is picked once, at the first
+ * allocation, from the HEAPTOSS_ALLOCATOR environment variable:
+ *
+ *  - malloc: The system allocator. This is the default.
+ *  - pool:   Per-thread free lists of power-of-two size classes, carved out of slabs that
+ *            belong to the thread. Blocks freed by another thread go back to their owner.
+ *  - bump:   Per-thread bump regions. Frames are mostly freed in LIFO order, which pops
+ *            them off the region. The current chunk is reset once everything in it has
+ *            been freed, and older chunks are released once everything in them has.
+ *
+ * If HEAPTOSS_ALLOC_REPORT is set, the backend's counters are printed to stderr at exit.
+ *
+ * Functions the pass gives a static frame instead (-ht-static-frames) do not allocate at
+ * all, but may call heaptoss_frame_enter to check that they are not reentered.
+ */
+
+using namespace std;
+
+//Size classes of the pool backend: 16, 32, ..., 4096 bytes. Larger blocks go to malloc.
+#define POOL_MIN_CLASS_SHIFT 4
+#define POOL_NUM_CLASSES 9
+#define POOL_MAX_BLOCK (((size_t) 1) << (POOL_MIN_CLASS_SHIFT + POOL_NUM_CLASSES - 1))
+//Slabs are aligned to their size, so a block's slab (and owner) is found by masking.
+#define POOL_SLAB_SIZE (64 * 1024)
+//Bump chunks are aligned to their size for the same reason. Blocks larger than a quarter
+//of a chunk go to malloc.
+#define BUMP_CHUNK_SIZE (1024 * 1024)
+#define BUMP_MAX_BLOCK (BUMP_CHUNK_SIZE / 4)
+//malloc only guarantees this much alignment.
+#define MALLOC_ALIGNMENT 16
+#define CACHE_LINE_SIZE 64
+
+enum HeapTossBackend {
+  BACKEND_MALLOC = 0,
+  BACKEND_POOL = 1,
+  BACKEND_BUMP = 2
+};
+
+static const char * backendNames[] = { "malloc", "pool", "bump" };
+
+//Counters of the allocation ABI. Kept per thread, and summed up on request.
+struct HeapTossAllocStats {
+  unsigned long long allocs;
+  unsigned long long frees;
+  //Allocations that were too large for the backend, and went to malloc.
+  unsigned long long largeAllocs;
+  //Blocks freed by a thread other than the one that allocated them.
+  unsigned long long crossThreadFrees;
+  //Times a thread had to wait for another thread's lock.
+  unsigned long long lockContentions;
+};
+
+struct HeapTossThreadState;
+
+struct FreeBlock {
+  FreeBlock * next;
+};
+
+//Header at the start of every pool slab.
+struct PoolSlab {
+  HeapTossThreadState * owner;
+};
+
+//Header at the start of every bump chunk.
+struct BumpChunk {
+  HeapTossThreadState * owner;
+  //Blocks in this chunk that have not been freed yet, plus one while it is its owner's
+  //current chunk. Whoever drops it to 0 releases the chunk.
+  size_t refs;
+};
+
+//Everything one thread's allocations need. Never freed, since other threads may still
+//free blocks that belong to it after it exits. Each one starts on a cache line of its own,
+//so that threads do not slow each other down by writing their counters.
+struct HeapTossThreadState {
+  HeapTossAllocStats stats;
+
+  //Pool backend.
+  FreeBlock * freeLists[POOL_NUM_CLASSES];
+  char * slabCursor[POOL_NUM_CLASSES];
+  char * slabEnd[POOL_NUM_CLASSES];
+  //Blocks freed by other threads. Protected by remoteLock.
+  pthread_mutex_t remoteLock;
+  FreeBlock * remoteFrees[POOL_NUM_CLASSES];
+  bool hasRemoteFrees;
+
+  //Bump backend.
+  BumpChunk * chunk;
+  char * bumpCursor;
+  //A released chunk kept around for reuse.
+  BumpChunk * spareChunk;
+
+  HeapTossThreadState * next;
+  //Keeps the next thread's state off of our last cache line.
+  char padding[CACHE_LINE_SIZE];
+};
+
+static HeapTossBackend backend;
+static pthread_once_t backendOnce = PTHREAD_ONCE_INIT;
+
+//Every thread's state, so that we can sum up the counters.
+static pthread_mutex_t threadsLock = PTHREAD_MUTEX_INITIALIZER;
+static HeapTossThreadState * threads;
+
+static __thread HeapTossThreadState * threadState;
+
+extern "C" void heaptoss_alloc_report(void) __attribute__ ((destructor));
+
+static void selectBackend() {
+  backend = BACKEND_MALLOC;
+
+  const char * name = getenv("HEAPTOSS_ALLOCATOR");
+  if (name == NULL) return;
+
+  for (unsigned b = 0; b < sizeof(backendNames) / sizeof(backendNames[0]); b++) {
+    if (strcmp(name, backendNames[b]) == 0) {
+      backend = (HeapTossBackend) b;
+      return;
+    }
+  }
+
+  cerr << "HeapToss: unknown allocator '" << name << "'; using malloc.\n";
+}
+
+static HeapTossThreadState * getThreadState() {
+  if (threadState != NULL) return threadState;
+
+  void * memory;
+  if (posix_memalign(&memory, CACHE_LINE_SIZE, sizeof(HeapTossThreadState)) != 0) abort();
+  memset(memory, 0, sizeof(HeapTossThreadState));
+  threadState = (HeapTossThreadState *) memory;
+  pthread_mutex_init(&threadState->remoteLock, NULL);
+
+  pthread_mutex_lock(&threadsLock);
+  threadState->next = threads;
+  threads = threadState;
+  pthread_mutex_unlock(&threadsLock);
+
+  return threadState;
+}
+
+/**
+ * Takes lock, and counts it if some other thread had it first.
+ */
+static void lockCounted(pthread_mutex_t * lock, HeapTossThreadState * state) {
+  if (pthread_mutex_trylock(lock) != 0) {
+    state->stats.lockContentions++;
+    pthread_mutex_lock(lock);
+  }
+}
+
+/**
+ * Returns memory aligned to its size, or NULL.
+ */
+static void * allocAligned(size_t size) {
+  void * memory;
+  if (posix_memalign(&memory, size, size) != 0) return NULL;
+  return memory;
+}
+
+static void * mallocAlloc(size_t size, size_t align) {
+  if (align <= MALLOC_ALIGNMENT) return malloc(size);
+
+  void * memory;
+  if (posix_memalign(&memory, align, size) != 0) return NULL;
+  return memory;
+}
+
+/**
+ * Returns the pool size class that can hold size bytes at the given alignment.
+ * Blocks of a class are aligned to their size.
+ */
+static inline unsigned poolClass(size_t size, size_t align) {
+  if (align > size) size = align;
+
+  unsigned sizeClass = 0;
+  while ((((size_t) 1) << (POOL_MIN_CLASS_SHIFT + sizeClass)) < size) sizeClass++;
+  return sizeClass;
+}
+
+static void * poolAlloc(HeapTossThreadState * state, size_t size, size_t align) {
+  if (size > POOL_MAX_BLOCK || align > POOL_MAX_BLOCK) {
+    state->stats.largeAllocs++;
+    return mallocAlloc(size, align);
+  }
+
+  unsigned sizeClass = poolClass(size, align);
+  size_t blockSize = ((size_t) 1) << (POOL_MIN_CLASS_SHIFT + sizeClass);
+
+  //Take back what other threads freed before carving out new blocks.
+  if (state->freeLists[sizeClass] == NULL && state->hasRemoteFrees) {
+    lockCounted(&state->remoteLock, state);
+    for (unsigned c = 0; c < POOL_NUM_CLASSES; c++) {
+      while (state->remoteFrees[c] != NULL) {
+        FreeBlock * block = state->remoteFrees[c];
+        state->remoteFrees[c] = block->next;
+        block->next = state->freeLists[c];
+        state->freeLists[c] = block;
+      }
+    }
+    state->hasRemoteFrees = false;
+    pthread_mutex_unlock(&state->remoteLock);
+  }
+
+  FreeBlock * block = state->freeLists[sizeClass];
+  if (block != NULL) {
+    state->freeLists[sizeClass] = block->next;
+    return block;
+  }
+
+  if (state->slabCursor[sizeClass] == state->slabEnd[sizeClass]) {
+    char * slab = (char *) allocAligned(POOL_SLAB_SIZE);
+    if (slab == NULL) return NULL;
+    ((PoolSlab *) slab)->owner = state;
+
+    //Keep blocks aligned to their size.
+    size_t headerSize = sizeof(PoolSlab) > blockSize ? sizeof(PoolSlab) : blockSize;
+    state->slabCursor[sizeClass] = slab + headerSize;
+    state->slabEnd[sizeClass] = slab + POOL_SLAB_SIZE;
+  }
+
+  void * memory = state->slabCursor[sizeClass];
+  state->slabCursor[sizeClass] += blockSize;
+  return memory;
+}
+
+static void poolFree(HeapTossThreadState * state, void * ptr, size_t size, size_t align) {
+  if (size > POOL_MAX_BLOCK || align > POOL_MAX_BLOCK) {
+    free(ptr);
+    return;
+  }
+
+  unsigned sizeClass = poolClass(size, align);
+  FreeBlock * block = (FreeBlock *) ptr;
+  PoolSlab * slab = (PoolSlab *) ((uintptr_t) ptr & ~((uintptr_t) POOL_SLAB_SIZE - 1));
+  HeapTossThreadState * owner = slab->owner;
+
+  if (owner == state) {
+    block->next = state->freeLists[sizeClass];
+    state->freeLists[sizeClass] = block;
+    return;
+  }
+
+  state->stats.crossThreadFrees++;
+  lockCounted(&owner->remoteLock, state);
+  block->next = owner->remoteFrees[sizeClass];
+  owner->remoteFrees[sizeClass] = block;
+  owner->hasRemoteFrees = true;
+  pthread_mutex_unlock(&owner->remoteLock);
+}
+
+static inline char * alignUp(char * ptr, size_t align) {
+  return (char *) (((uintptr_t) ptr + align - 1) & ~((uintptr_t) align - 1));
+}
+
+/**
+ * Drops a reference to chunk. Keeps the chunk as the spare if it was the last one.
+ */
+static void releaseChunkRef(HeapTossThreadState * state, BumpChunk * chunk) {
+  if (__sync_sub_and_fetch(&chunk->refs, 1) != 0) return;
+
+  if (chunk->owner == state && state->spareChunk == NULL) {
+    state->spareChunk = chunk;
+  }
+  else {
+    free(chunk);
+  }
+}
+
+static void * bumpAlloc(HeapTossThreadState * state, size_t size, size_t align) {
+  if (size > BUMP_MAX_BLOCK || align > BUMP_MAX_BLOCK) {
+    state->stats.largeAllocs++;
+    return mallocAlloc(size, align);
+  }
+  if (align < MALLOC_ALIGNMENT) align = MALLOC_ALIGNMENT;
+
+  char * memory = state->chunk == NULL ? NULL : alignUp(state->bumpCursor, align);
+  if (memory == NULL || memory + size > (char *) state->chunk + BUMP_CHUNK_SIZE) {
+    //Retire the current chunk. It goes away once its blocks do.
+    if (state->chunk != NULL) releaseChunkRef(state, state->chunk);
+
+    BumpChunk * chunk = state->spareChunk;
+    if (chunk != NULL) {
+      state->spareChunk = NULL;
+    }
+    else {
+      chunk = (BumpChunk *) allocAligned(BUMP_CHUNK_SIZE);
+      if (chunk == NULL) {
+        state->chunk = NULL;
+        return NULL;
+      }
+      chunk->owner = state;
+    }
+    chunk->refs = 1;
+    state->chunk = chunk;
+    memory = alignUp((char *) (chunk + 1), align);
+  }
+
+  __sync_fetch_and_add(&state->chunk->refs, 1);
+  state->bumpCursor = memory + size;
+  return memory;
+}
+
+static void bumpFree(HeapTossThreadState * state, void * ptr, size_t size, size_t align) {
+  if (size > BUMP_MAX_BLOCK || align > BUMP_MAX_BLOCK) {
+    free(ptr);
+    return;
+  }
+
+  BumpChunk * chunk = (BumpChunk *) ((uintptr_t) ptr & ~((uintptr_t) BUMP_CHUNK_SIZE - 1));
+  if (chunk->owner != state) {
+    state->stats.crossThreadFrees++;
+  }
+
+  if (chunk != state->chunk) {
+    releaseChunkRef(state, chunk);
+    return;
+  }
+
+  //Our current chunk. It holds a reference of its own, so this never releases it.
+  if (__sync_sub_and_fetch(&chunk->refs, 1) == 1) {
+    //Everything in it is dead.
+    state->bumpCursor = (char *) (chunk + 1);
+  }
+  //Pop the block if it is on top of the region.
+  else if ((char *) ptr + size == state->bumpCursor) {
+    state->bumpCursor = (char *) ptr;
+  }
+}
+
+extern "C" void * heaptoss_alloc(size_t size, size_t align) {
+  pthread_once(&backendOnce, selectBackend);
+  HeapTossThreadState * state = getThreadState();
+  state->stats.allocs++;
+
+  switch (backend) {
+    case BACKEND_POOL:
+      return poolAlloc(state, size, align);
+    case BACKEND_BUMP:
+      return bumpAlloc(state, size, align);
+    default:
+      return mallocAlloc(size, align);
+  }
+}
+
+extern "C" void heaptoss_free(void * ptr, size_t size, size_t align) {
+  if (ptr == NULL) return;
+
+  HeapTossThreadState * state = getThreadState();
+  state->stats.frees++;
+
+  switch (backend) {
+    case BACKEND_POOL:
+      poolFree(state, ptr, size, align);
+      break;
+    case BACKEND_BUMP:
+      bumpFree(state, ptr, size, align);
+      break;
+    default:
+      free(ptr);
+  }
+}
+
+/**
+ * Called on entry to a function with a static frame when the pass checks for reentrancy.
+ * busy is the function's flag, which the function clears when it leaves.
+ */
+extern "C" void heaptoss_frame_enter(char * busy, const char * fcnName) {
+  if (*busy) {
+    cerr << "HeapToss: " << fcnName << " was entered again while its static frame was in use. "
+        << "It must not be given a static frame.\n";
+    abort();
+  }
+  *busy = 1;
+}
+
+/**
+ * Sums up the counters of every thread into stats. Returns the name of the backend.
+ */
+extern "C" const char * heaptoss_alloc_get_stats(HeapTossAllocStats * stats) {
+  memset(stats, 0, sizeof(HeapTossAllocStats));
+
+  pthread_mutex_lock(&threadsLock);
+  for (HeapTossThreadState * state = threads; state != NULL; state = state->next) {
+    stats->allocs += state->stats.allocs;
+    stats->frees += state->stats.frees;
+    stats->largeAllocs += state->stats.largeAllocs;
+    stats->crossThreadFrees += state->stats.crossThreadFrees;
+    stats->lockContentions += state->stats.lockContentions;
+  }
+  pthread_mutex_unlock(&threadsLock);
+
+  pthread_once(&backendOnce, selectBackend);
+  return backendNames[backend];
+}
+
+extern "C" void heaptoss_alloc_report(void) {
+  if (getenv("HEAPTOSS_ALLOC_REPORT") == NULL) return;
+
+  HeapTossAllocStats stats;
+  const char * name = heaptoss_alloc_get_stats(&stats);
+  cerr << "heaptoss-alloc: backend=" << name << " allocs=" << stats.allocs << " frees=" << stats.frees
+      << " large_allocs=" << stats.largeAllocs << " cross_thread_frees=" << stats.crossThreadFrees
+      << " lock_contentions=" << stats.lockContentions << "\n";
+}
@@ -0,0 +1,114 @@
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+
+/* Toss flags of functions built with -ht-multiversion.
+ *
+ * Every such function has a tossed and an untossed body, and picks one on entry from its
+ * toss flag. Each module registers a table of its flags from a constructor. The flags
+ * start out set (tossed), and are then set from the HEAPTOSS_TOSS environment variable: a
+ * comma-separated list of entries, applied in order:
+ *
+ *  - all:    Toss in every function.
+ *  - none:   Toss in no function.
+ *  - name:   Toss in the function with this (mangled) name.
+ *  - -name:  Do not toss in the function with this name.
+ *
+ * So "none,foo" only tosses in foo, and "-foo" tosses everywhere but foo. The program can
+ * change the flags later with heaptoss_set_tossing. Calls that are already running keep the
+ * body they started with.
+ */
+
+using namespace std;
+
+//Table emitted by the pass into every module built with -ht-multiversion. The layout must
+//match the one in HeapTossPass::insertVersionRegistration.
+struct HeapTossVersionTable {
+  size_t numFunctions;
+  const char ** fcnNames;
+  //Indexed like fcnNames. Nonzero if the function runs its tossed body.
+  char ** tossFlags;
+};
+
+struct HeapTossVersionRecord {
+  HeapTossVersionTable * table;
+  HeapTossVersionRecord * next;
+};
+
+static HeapTossVersionRecord * firstTable;
+static pthread_mutex_t tablesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Sets the flag of every function named name in table, or of every function if name is
+ * NULL. Returns how many flags were set.
+ */
+static size_t setTossing(HeapTossVersionTable * table, const char * name, size_t nameLength, bool tossing) {
+  size_t count = 0;
+  for (size_t f = 0; f < table->numFunctions; f++) {
+    if (name == NULL || (strncmp(table->fcnNames[f], name, nameLength) == 0 && table->fcnNames[f][nameLength] == '\0')) {
+      *table->tossFlags[f] = tossing;
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+ * Applies HEAPTOSS_TOSS to a newly registered table.
+ */
+static void applyEnvironment(HeapTossVersionTable * table) {
+  const char * setting = getenv("HEAPTOSS_TOSS");
+  if (setting == NULL) return;
+
+  while (*setting != '\0') {
+    const char * end = strchr(setting, ',');
+    size_t length = end == NULL ? strlen(setting) : end - setting;
+
+    if (length == 3 && strncmp(setting, "all", 3) == 0) {
+      setTossing(table, NULL, 0, true);
+    }
+    else if (length == 4 && strncmp(setting, "none", 4) == 0) {
+      setTossing(table, NULL, 0, false);
+    }
+    else if (length > 1 && setting[0] == '-') {
+      setTossing(table, setting + 1, length - 1, false);
+    }
+    else if (length > 0) {
+      setTossing(table, setting, length, true);
+    }
+
+    setting += length;
+    if (*setting == ',') setting++;
+  }
+}
+
+/**
+ * Called from the constructor of every module built with -ht-multiversion.
+ */
+extern "C" void heaptoss_register_versions(HeapTossVersionTable * table) {
+  HeapTossVersionRecord * record = new HeapTossVersionRecord();
+  record->table = table;
+  applyEnvironment(table);
+
+  pthread_mutex_lock(&tablesLock);
+  record->next = firstTable;
+  firstTable = record;
+  pthread_mutex_unlock(&tablesLock);
+}
+
+/**
+ * Turns tossing on or off in the function with the given (mangled) name, or in every
+ * function if name is NULL or "all". Returns how many functions changed, counting every
+ * module that has a function of that name.
+ */
+extern "C" size_t heaptoss_set_tossing(const char * name, int tossing) {
+  if (name != NULL && strcmp(name, "all") == 0) name = NULL;
+
+  size_t count = 0;
+  pthread_mutex_lock(&tablesLock);
+  for (HeapTossVersionRecord * record = firstTable; record != NULL; record = record->next) {
+    count += setTossing(record->table, name, name == NULL ? 0 : strlen(name), tossing != 0);
+  }
+  pthread_mutex_unlock(&tablesLock);
+  return count;
+}
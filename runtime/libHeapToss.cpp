@@ -3,29 +3,189 @@
 #include <fstream>
 #include <sstream>
 #include <cstdlib>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <pthread.h>
 
-//Toggles dynamic toss stats. We don't do dyntoss stuff yet, so disable it for now.
-#define ENABLE_DYN_TOSS_STATS 0
+//Toggles dynamic toss stats. Their memory use is fixed per function, so they are on by default.
+#define ENABLE_DYN_TOSS_STATS 1
 #define NUM_MEMINTRINSICS 3
+//Unversioned, aligned and unaligned. Must match MemIntrinsicPath in HeapTossStats.h.
+#define NUM_MEMINTRINSIC_PATHS 3
+//Number of call sites kept in the shadow context. Must match HT_CONTEXT_DEPTH in HeapTossStats.h.
+#define HT_CONTEXT_DEPTH 8
+//Number of entries in the context profile. Must be a power of two.
+#define NUM_CONTEXT_ENTRIES 4096
+//Log2 histogram buckets: bucket 0 holds 0, bucket b > 0 holds [2^(b-1), 2^b).
+#define NUM_HIST_BUCKETS (sizeof(size_t) * 8 + 1)
 
 using namespace std;
 
-//Arrays
-static unsigned * fcnRunCounts;
-static size_t * fcnMallocSize;
-static unsigned * fcnDynTossCounts;
-//Two levels. Basically, we want to know the distribution of how large dynamic tosses are across all
-//calls to a function.
-static map<unsigned, map<unsigned, size_t> > fcnDynTossSizes;
-static map<unsigned, map<unsigned, unsigned> > fcnDynTossMallocCalls;
-static unsigned * unfreedMallocs;
-static unsigned numFunctions;
+//Dynamic tosses of a single call. The pass keeps one in the frame of every call that may
+//toss dynamically, so calls on other threads and recursive calls each have their own. The
+//layout must match HeapTossStats::getDynTossCall.
+struct HeapTossDynTossCall {
+  size_t bytes;
+  size_t mallocCalls;
+};
+
+//Distribution of dynamic tosses over the calls of a single function. Each call is added
+//once it ends.
+struct HeapTossDynTossStats {
+  //High-water marks over all calls.
+  size_t maxBytes;
+  size_t maxMallocCalls;
+  unsigned bytesPerCall[NUM_HIST_BUCKETS];
+  unsigned mallocCallsPerCall[NUM_HIST_BUCKETS];
+};
+
+//Per-function counters. One of these exists for every function in every registered module.
+struct HeapTossFcnStats {
+  unsigned runCount;
+  size_t mallocSize;
+  unsigned dynTossCount;
+  unsigned unfreedMallocs;
+#if ENABLE_DYN_TOSS_STATS == 1
+  HeapTossDynTossStats dynToss;
+#endif
+};
+
+//Module table emitted by the pass into every instrumented module. The layout must match
+//HeapTossStats::moduleTableType.
+struct HeapTossModule {
+  size_t numFunctions;
+  const char * moduleName;
+  //Indexed by function ID.
+  const char ** fcnNames;
+  //Filled in by heaptoss_register_module. Indexed by function ID.
+  HeapTossFcnStats * fcnStats;
+};
+
+//The runtime's own copy of a registered module. It keeps its own copy of the names, so
+//we can still print the stats of a dlopen'd module after it has been dlclose'd.
+struct HeapTossModuleRecord {
+  string moduleName;
+  vector<string> fcnNames;
+  HeapTossFcnStats * fcnStats;
+  HeapTossModuleRecord * next;
+};
+
+//Call site descriptor emitted by the pass for ht-context-profile. The layout must match
+//HeapTossStats::callSiteType.
+struct HeapTossCallSite {
+  const char * callerName;
+  unsigned line;
+};
+
+//Thread-local shadow context, maintained by instrumented code. heaptoss_ctx_depth is the
+//number of instrumented calls on this thread's stack; the innermost HT_CONTEXT_DEPTH of them
+//are in heaptoss_ctx_stack, indexed by depth modulo HT_CONTEXT_DEPTH.
+extern "C" __thread const HeapTossCallSite * heaptoss_ctx_stack[HT_CONTEXT_DEPTH];
+extern "C" __thread size_t heaptoss_ctx_depth;
+__thread const HeapTossCallSite * heaptoss_ctx_stack[HT_CONTEXT_DEPTH];
+__thread size_t heaptoss_ctx_depth;
+
+//A call site in the context profile. The descriptors live in the constant data of their
+//module, which may be dlclose'd before we print, so the profile keeps its own copy.
+struct HeapTossContextFrame {
+  const char * callerName;
+  unsigned line;
+};
+
+//Toss counts and bytes for one calling context. The context is the tossing function plus
+//the call sites that led to it, outermost first.
+struct HeapTossContext {
+  size_t hash;
+  //The tossing function, by name, so that a module that is reloaded adds to the contexts
+  //it had before. NULL for an empty slot.
+  const char * leafModule;
+  const char * leafName;
+  unsigned numFrames;
+  //True if the context was deeper than HT_CONTEXT_DEPTH.
+  bool truncated;
+  HeapTossContextFrame frames[HT_CONTEXT_DEPTH];
+  unsigned long long tossCount;
+  unsigned long long tossBytes;
+};
+
+//Open-addressing table of contexts. Tosses from contexts that do not fit are counted in
+//droppedContextTosses.
+static HeapTossContext contexts[NUM_CONTEXT_ENTRIES];
+static unsigned numContexts;
+static unsigned long long droppedContextTosses;
+
+//Registered modules, in registration order. Plain pointers so that they are valid before
+//any static constructor in this library has run.
+static HeapTossModuleRecord * firstModule;
+static HeapTossModuleRecord * lastModule;
+static unsigned numModules;
 
 //An array maps that record the distribution of sizes for each memintrinsic type.
 static map<size_t, unsigned> memIntrinsicSizes[NUM_MEMINTRINSICS];
+//How often each version of each memintrinsic type runs.
+static unsigned long long memIntrinsicPaths[NUM_MEMINTRINSICS][NUM_MEMINTRINSIC_PATHS];
+static const char * memIntrinsicPathNames[NUM_MEMINTRINSIC_PATHS] = { "Unversioned", "Aligned", "Unaligned" };
+
+//Instrumented code may run on many threads. Plain counters are updated atomically, and
+//everything else (the memintrinsic size maps, the dynamic toss histograms and the context
+//profile) under this lock.
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
 
 extern "C" void heaptoss_print_result(void) __attribute__ ((destructor));
 
+/**
+ * Returns the log2 histogram bucket for the given value.
+ */
+static inline unsigned histBucket(size_t value) {
+  unsigned bucket = 0;
+  while (value != 0) {
+    value >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+/**
+ * Adds a call that has ended to the function's histograms. Must hold statsLock.
+ */
+static void addDynTossCall(HeapTossDynTossStats & dynToss, const HeapTossDynTossCall & call) {
+  dynToss.bytesPerCall[histBucket(call.bytes)]++;
+  dynToss.mallocCallsPerCall[histBucket(call.mallocCalls)]++;
+  if (call.bytes > dynToss.maxBytes) dynToss.maxBytes = call.bytes;
+  if (call.mallocCalls > dynToss.maxMallocCalls) dynToss.maxMallocCalls = call.mallocCalls;
+}
+
+/**
+ * Prints one histogram row of the dynamic toss stats.
+ */
+static void printHistogram(ofstream & outFile, unsigned moduleId, unsigned fcnId, const string & fcnName,
+    const char * histName, size_t highWaterMark, const unsigned * hist) {
+  outFile << moduleId << "," << fcnId << "," << fcnName << "," << histName << "," << highWaterMark;
+  for (unsigned b = 0; b < NUM_HIST_BUCKETS; b++) {
+    outFile << "," << hist[b];
+  }
+  outFile << "\n";
+}
+
+/**
+ * Prints every context in collapsed-stack format: frames separated by ';', then the value.
+ */
+static void printContexts(ofstream & outFile, bool bytes) {
+  for (unsigned c = 0; c < NUM_CONTEXT_ENTRIES; c++) {
+    HeapTossContext & context = contexts[c];
+    if (context.leafName == NULL) continue;
+
+    if (context.truncated) outFile << "[truncated];";
+    for (unsigned f = 0; f < context.numFrames; f++) {
+      outFile << context.frames[f].callerName;
+      if (context.frames[f].line != 0) outFile << ":" << context.frames[f].line;
+      outFile << ";";
+    }
+    outFile << context.leafName << " " << (bytes ? context.tossBytes : context.tossCount) << "\n";
+  }
+}
+
 bool fexists(const char *filename)
 {
   ifstream ifile(filename);
@@ -34,12 +194,15 @@ bool fexists(const char *filename)
 
 extern "C" void heaptoss_print_result(void) {
   stringstream outputFileName;
+  //Keeps the string that filename points into alive.
+  string filenameStr;
   const char* filename;
   unsigned i = 0;
   do {
     outputFileName.str(std::string());
     outputFileName << "htstats_run_" << i++ << ".csv";
-    filename = outputFileName.str().c_str();
+    filenameStr = outputFileName.str();
+    filename = filenameStr.c_str();
   } while (fexists(filename));
   i--; //It was incremented one more than needed.
   ofstream outFile;
@@ -48,53 +211,59 @@ extern "C" void heaptoss_print_result(void) {
   unsigned long long totalMallocCalls = 0;
 
   //FUNCTIONS THAT RUN AND TOSS
-  outFile << "ID,Execution Count,Malloc Size,Dynamic Toss Count,Unfreed Mallocs\n";
-  for (unsigned i = 0; i < numFunctions; i++) {
-    unsigned fcnId = i;
-    unsigned unfreed = unfreedMallocs[fcnId];
+  outFile << "Module,ID,Function Name,Execution Count,Malloc Size,Dynamic Toss Count,Unfreed Mallocs\n";
+  unsigned moduleId = 0;
+  for (HeapTossModuleRecord * module = firstModule; module != NULL; module = module->next, moduleId++) {
+    for (unsigned fcnId = 0; fcnId < module->fcnNames.size(); fcnId++) {
+      HeapTossFcnStats & fcn = module->fcnStats[fcnId];
+      unsigned unfreed = fcn.unfreedMallocs;
 
-    //Ignore functions that don't execute and don't toss.
-    if (fcnRunCounts[fcnId] == 0 || fcnMallocSize[fcnId] == 0) continue;
+      //Ignore functions that don't execute and don't toss.
+      if (fcn.runCount == 0 || fcn.mallocSize == 0) continue;
 
-    totalMallocCalls += fcnRunCounts[fcnId];
+      totalMallocCalls += fcn.runCount;
 
-    //There's actually no malloc calls.
-    if (fcnMallocSize[fcnId] == 0 && fcnRunCounts[fcnId] == unfreed)
-      unfreed = 0;
-
-    //Print out details.
-    outFile << fcnId << "," << fcnRunCounts[fcnId] << "," << fcnMallocSize[fcnId] << "," << fcnDynTossCounts[fcnId] << "," << unfreed << "\n";
+      //Print out details.
+      outFile << moduleId << "," << fcnId << "," << module->fcnNames[fcnId] << "," << fcn.runCount << ","
+          << fcn.mallocSize << "," << fcn.dynTossCount << "," << unfreed << "\n";
+    }
   }
   outFile.close();
 
   outputFileName.str(std::string());
   outputFileName << "htstats_run_" << i << "_no_locals.csv";
-  filename = outputFileName.str().c_str();
+  filenameStr = outputFileName.str();
+  filename = filenameStr.c_str();
   outFile.open(filename, ios::out);
 
 
   //FUNCTIONS THAT RUN AND DON'T TOSS
-  outFile << "ID,Execution Count,Malloc Size,Dynamic Toss Count,Unfreed Mallocs\n";
-  for (unsigned i = 0; i < numFunctions; i++) {
-    unsigned fcnId = i;
-    unsigned unfreed = unfreedMallocs[fcnId];
-
-    //We only want functions that execute and don't toss.
-    if (fcnRunCounts[fcnId] == 0 || fcnMallocSize[fcnId] != 0) continue;
-
-    //There's actually no malloc calls.
-    if (fcnMallocSize[fcnId] == 0 && fcnRunCounts[fcnId] == unfreed)
-      unfreed = 0;
-
-    //Print out details.
-    outFile << fcnId << "," << fcnRunCounts[fcnId] << "," << fcnMallocSize[fcnId] << "," << fcnDynTossCounts[fcnId] << "," << unfreed << "\n";
+  outFile << "Module,ID,Function Name,Execution Count,Malloc Size,Dynamic Toss Count,Unfreed Mallocs\n";
+  moduleId = 0;
+  for (HeapTossModuleRecord * module = firstModule; module != NULL; module = module->next, moduleId++) {
+    for (unsigned fcnId = 0; fcnId < module->fcnNames.size(); fcnId++) {
+      HeapTossFcnStats & fcn = module->fcnStats[fcnId];
+      unsigned unfreed = fcn.unfreedMallocs;
+
+      //We only want functions that execute and don't toss.
+      if (fcn.runCount == 0 || fcn.mallocSize != 0) continue;
+
+      //There's actually no malloc calls.
+      if (fcn.runCount == unfreed)
+        unfreed = 0;
+
+      //Print out details.
+      outFile << moduleId << "," << fcnId << "," << module->fcnNames[fcnId] << "," << fcn.runCount << ","
+          << fcn.mallocSize << "," << fcn.dynTossCount << "," << unfreed << "\n";
+    }
   }
 
   outFile.close();
 
   outputFileName.str(std::string());
   outputFileName << "htstats_run_" << i << "_intrinsics.csv";
-  filename = outputFileName.str().c_str();
+  filenameStr = outputFileName.str();
+  filename = filenameStr.c_str();
   outFile.open(filename, ios::out);
 
   //INTRINSIC STATS
@@ -107,90 +276,258 @@ extern "C" void heaptoss_print_result(void) {
 
   outFile.close();
 
+  outputFileName.str(std::string());
+  outputFileName << "htstats_run_" << i << "_intrinsic_paths.csv";
+  filenameStr = outputFileName.str();
+  filename = filenameStr.c_str();
+  outFile.open(filename, ios::out);
+
+  //INTRINSIC ALIGNMENT PATHS
+  outFile << "IntrinsicId,Path,Count\n";
+  for (unsigned i = 0; i < NUM_MEMINTRINSICS; i++) {
+    for (unsigned path = 0; path < NUM_MEMINTRINSIC_PATHS; path++) {
+      outFile << i << "," << memIntrinsicPathNames[path] << "," << memIntrinsicPaths[i][path] << "\n";
+    }
+  }
+
+  outFile.close();
+
   outputFileName.str(std::string());
   outputFileName << "htstats_run_" << i << "_general_stats.csv";
-  filename = outputFileName.str().c_str();
+  filenameStr = outputFileName.str();
+  filename = filenameStr.c_str();
   outFile.open(filename, ios::out);
 
   //GENERAL STATS
+  outFile << "Registered modules," << numModules << "\n";
   outFile << "Total calls to malloc/free," << totalMallocCalls << "\n";
 
 
+  outFile.close();
+
 #if ENABLE_DYN_TOSS_STATS == 1
-  outFile << "\n";
-  outFile << "ID,Dynamic Toss Sizes...\n";
-  for (map<unsigned, map<unsigned, size_t> >::iterator i = fcnDynTossSizes.begin(); i != fcnDynTossSizes.end(); i++) {
-    outFile << i->first;
-    map<unsigned, size_t> dynTossSizes;
-    for (map<unsigned,size_t>::iterator j = dynTossSizes.begin(); j != dynTossSizes.end(); j++) {
-      outFile << "," << j->second;
-    }
-    outFile << "\n";
-  }
+  outputFileName.str(std::string());
+  outputFileName << "htstats_run_" << i << "_dyn_toss.csv";
+  filenameStr = outputFileName.str();
+  filename = filenameStr.c_str();
+  outFile.open(filename, ios::out);
 
+  //DYNAMIC TOSS STATS
+  //One row per histogram. Bucket columns are labeled with their lower bound.
+  outFile << "Module,ID,Function Name,Histogram,High-Water Mark";
+  for (unsigned b = 0; b < NUM_HIST_BUCKETS; b++) {
+    outFile << "," << (b == 0 ? 0 : ((size_t) 1) << (b - 1));
+  }
   outFile << "\n";
-  outFile << "ID,# Malloc Calls...\n";
-  for (map<unsigned, map<unsigned, unsigned> >::iterator i = fcnDynTossMallocCalls.begin(); i != fcnDynTossMallocCalls.end(); i++) {
-    outFile << i->first;
-    map<unsigned, unsigned> mallocCalls;
-    for (map<unsigned,unsigned>::iterator j = mallocCalls.begin(); j != mallocCalls.end(); j++) {
-      outFile << "," << j->second;
+  moduleId = 0;
+  for (HeapTossModuleRecord * module = firstModule; module != NULL; module = module->next, moduleId++) {
+    for (unsigned fcnId = 0; fcnId < module->fcnNames.size(); fcnId++) {
+      HeapTossFcnStats & fcn = module->fcnStats[fcnId];
+      if (fcn.dynTossCount == 0) continue;
+
+      printHistogram(outFile, moduleId, fcnId, module->fcnNames[fcnId], "Bytes Per Call",
+          fcn.dynToss.maxBytes, fcn.dynToss.bytesPerCall);
+      printHistogram(outFile, moduleId, fcnId, module->fcnNames[fcnId], "Mallocs Per Call",
+          fcn.dynToss.maxMallocCalls, fcn.dynToss.mallocCallsPerCall);
     }
-    outFile << "\n";
   }
 #endif
 
   outFile.close();
 
-  //Free variables.
-  free(fcnRunCounts);
-  free(fcnMallocSize);
-  free(fcnDynTossCounts);
-  free(unfreedMallocs);
+  if (numContexts > 0) {
+    //CONTEXT PROFILE
+    //Collapsed stacks, one file per metric. Feed either of them to flamegraph.pl.
+    outputFileName.str(std::string());
+    outputFileName << "htstats_run_" << i << "_context_tosses.folded";
+    filenameStr = outputFileName.str();
+    filename = filenameStr.c_str();
+    outFile.open(filename, ios::out);
+    printContexts(outFile, false);
+    outFile.close();
+
+    outputFileName.str(std::string());
+    outputFileName << "htstats_run_" << i << "_context_bytes.folded";
+    filenameStr = outputFileName.str();
+    filename = filenameStr.c_str();
+    outFile.open(filename, ios::out);
+    printContexts(outFile, true);
+    outFile.close();
+
+    if (droppedContextTosses > 0) {
+      cerr << "HeapToss: context profile is full; dropped " << droppedContextTosses << " tosses.\n";
+    }
+  }
+
+  //The records and counters are not freed: instrumented code may still run after us (other
+  //threads, or destructors that run later) and update them through its module table.
 }
 
-extern "C" void heaptoss_memintrinsic_execution(unsigned intrinsicId, size_t size) {
-  memIntrinsicSizes[intrinsicId][size]++;
+/**
+ * Called from the constructor of every instrumented module (executables, shared libraries
+ * and dlopen'd plugins alike). Allocates the module's counters and hooks them into its
+ * table, so every later lookup is a single index.
+ *
+ * The dynamic loader runs constructors under its own lock, but getFcnStats may also get
+ * here from any thread, so registration happens under statsLock.
+ */
+extern "C" void heaptoss_register_module(HeapTossModule * module) {
+  if (module->fcnStats != NULL) return;
+
+  pthread_mutex_lock(&statsLock);
+  //Another thread may have registered it while we waited.
+  if (module->fcnStats != NULL) {
+    pthread_mutex_unlock(&statsLock);
+    return;
+  }
+
+  HeapTossModuleRecord * record = new HeapTossModuleRecord();
+  record->moduleName = module->moduleName;
+  for (size_t fcnId = 0; fcnId < module->numFunctions; fcnId++) {
+    record->fcnNames.push_back(module->fcnNames[fcnId]);
+  }
+  //Initialize everything to 0 and allocate the memory. calloc(0) may return NULL, so
+  //always allocate at least one entry.
+  record->fcnStats = (HeapTossFcnStats*) calloc(module->numFunctions + 1, sizeof(HeapTossFcnStats));
+  record->next = NULL;
+
+  if (lastModule == NULL) {
+    firstModule = record;
+  }
+  else {
+    lastModule->next = record;
+  }
+  lastModule = record;
+  numModules++;
+
+  //The counters must be zeroed before other threads can see them without taking the lock.
+  __sync_synchronize();
+  module->fcnStats = record->fcnStats;
+  pthread_mutex_unlock(&statsLock);
 }
 
-extern "C" void heaptoss_dynamic_toss(unsigned fcnId, size_t size) {
-  fcnDynTossCounts[fcnId]++;
-  unsigned runNum = fcnRunCounts[fcnId];
-  fcnDynTossSizes[fcnId][runNum] += size;
-  fcnDynTossMallocCalls[fcnId][runNum]++;
+/**
+ * Returns the counters for the given function. Registers the module if one of its functions
+ * runs before its constructor did (e.g. from a higher-priority constructor).
+ */
+static inline HeapTossFcnStats & getFcnStats(HeapTossModule * module, size_t fcnId) {
+  if (module->fcnStats == NULL) heaptoss_register_module(module);
+  return module->fcnStats[fcnId];
 }
 
-extern "C" void heaptoss_malloc_size(unsigned fcnId, size_t size) {
-  fcnMallocSize[fcnId] = size;
+extern "C" void heaptoss_memintrinsic_execution(size_t intrinsicId, size_t size, size_t path) {
+  __sync_fetch_and_add(&memIntrinsicPaths[intrinsicId][path], 1);
+  pthread_mutex_lock(&statsLock);
+  memIntrinsicSizes[intrinsicId][size]++;
+  pthread_mutex_unlock(&statsLock);
 }
 
-extern "C" void heaptoss_fcn_ret(unsigned fcnId) {
-  unfreedMallocs[fcnId]--;
+/**
+ * Records a dynamic toss of the given size in call, which lives in the frame of the call
+ * that tossed, and so is only ever touched by one thread.
+ */
+extern "C" void heaptoss_dynamic_toss(HeapTossModule * module, size_t fcnId, size_t size, HeapTossDynTossCall * call) {
+  HeapTossFcnStats & fcn = getFcnStats(module, fcnId);
+  __sync_fetch_and_add(&fcn.dynTossCount, 1);
+  call->bytes += size;
+  call->mallocCalls++;
 }
 
-extern "C" void heaptoss_fcn_run(unsigned fcnId) {
-  if (fcnRunCounts[fcnId] == NULL) {
+/**
+ * Called when a call that may toss dynamically ends. Adds its tosses, if any, to the
+ * function's histograms.
+ */
+extern "C" void heaptoss_dynamic_toss_done(HeapTossModule * module, size_t fcnId, HeapTossDynTossCall * call) {
 #if ENABLE_DYN_TOSS_STATS == 1
-    fcnDynTossSizes[fcnId] = map<unsigned, size_t>();
-    fcnDynTossMallocCalls[fcnId] = map<unsigned, unsigned>();
+  if (call->mallocCalls == 0) return;
+
+  HeapTossFcnStats & fcn = getFcnStats(module, fcnId);
+  pthread_mutex_lock(&statsLock);
+  addDynTossCall(fcn.dynToss, *call);
+  pthread_mutex_unlock(&statsLock);
 #endif
+}
+
+/**
+ * Checks if context was recorded for the given call sites.
+ */
+static bool sameFrames(const HeapTossContext & context, const HeapTossCallSite * const * frames) {
+  for (unsigned f = 0; f < context.numFrames; f++) {
+    if (context.frames[f].line != frames[f]->line || strcmp(context.frames[f].callerName, frames[f]->callerName) != 0) {
+      return false;
+    }
   }
-  fcnRunCounts[fcnId]++;
-  unfreedMallocs[fcnId]++;
+  return true;
 }
 
-extern "C" void heaptoss_initialize(unsigned totalNumFunctions) {
-  /*static map<unsigned, map<unsigned, size_t> > fcnDynTossSizes;
-static map<unsigned, map<unsigned, unsigned> > fcnDynTossMallocCalls;
-   */
-  for (unsigned i = 0; i < NUM_MEMINTRINSICS; i++) {
-    memIntrinsicSizes[i] = map<size_t, unsigned>();
+/**
+ * Records a toss of the given size in the current thread's calling context.
+ */
+extern "C" void heaptoss_context_toss(HeapTossModule * module, size_t fcnId, size_t size) {
+  const char * leafModule = module->moduleName;
+  const char * leafName = module->fcnNames[fcnId];
+  size_t depth = heaptoss_ctx_depth;
+  unsigned numFrames = depth < HT_CONTEXT_DEPTH ? depth : HT_CONTEXT_DEPTH;
+
+  //Grab the innermost frames, outermost first, and hash what they say along with the leaf.
+  //Descriptors from a module that was reloaded have new addresses, so the hash must not
+  //depend on them.
+  const HeapTossCallSite * frames[HT_CONTEXT_DEPTH];
+  size_t hash = 0;
+  for (const char * c = leafModule; *c != '\0'; c++) hash = hash * 31 + *c;
+  for (const char * c = leafName; *c != '\0'; c++) hash = hash * 31 + *c;
+  for (unsigned f = 0; f < numFrames; f++) {
+    frames[f] = heaptoss_ctx_stack[(depth - numFrames + f) & (HT_CONTEXT_DEPTH - 1)];
+    for (const char * c = frames[f]->callerName; *c != '\0'; c++) hash = hash * 31 + *c;
+    hash = hash * 31 + frames[f]->line;
   }
+  hash ^= hash >> 17;
+
+  //Linear probing.
+  pthread_mutex_lock(&statsLock);
+  for (unsigned probe = 0; probe < NUM_CONTEXT_ENTRIES; probe++) {
+    HeapTossContext & context = contexts[(hash + probe) & (NUM_CONTEXT_ENTRIES - 1)];
+    if (context.leafName == NULL) {
+      //Keep one slot free so that failed lookups terminate early.
+      if (numContexts == NUM_CONTEXT_ENTRIES - 1) break;
+      context.hash = hash;
+      context.leafModule = strdup(leafModule);
+      context.leafName = strdup(leafName);
+      context.numFrames = numFrames;
+      context.truncated = depth > HT_CONTEXT_DEPTH;
+      //Never freed, like the rest of the profile.
+      for (unsigned f = 0; f < numFrames; f++) {
+        context.frames[f].callerName = strdup(frames[f]->callerName);
+        context.frames[f].line = frames[f]->line;
+      }
+      numContexts++;
+    }
+    else if (context.hash != hash || context.numFrames != numFrames
+        || context.truncated != (depth > HT_CONTEXT_DEPTH) || strcmp(context.leafName, leafName) != 0
+        || strcmp(context.leafModule, leafModule) != 0 || !sameFrames(context, frames)) {
+      continue;
+    }
+
+    context.tossCount++;
+    context.tossBytes += size;
+    pthread_mutex_unlock(&statsLock);
+    return;
+  }
+
+  droppedContextTosses++;
+  pthread_mutex_unlock(&statsLock);
+}
+
+extern "C" void heaptoss_malloc_size(HeapTossModule * module, size_t fcnId, size_t size) {
+  getFcnStats(module, fcnId).mallocSize = size;
+}
+
+extern "C" void heaptoss_fcn_ret(HeapTossModule * module, size_t fcnId) {
+  __sync_fetch_and_sub(&getFcnStats(module, fcnId).unfreedMallocs, 1);
+}
 
-  //Initialize everything to 0 and allocate the memory.
-  fcnRunCounts = (unsigned*) calloc(totalNumFunctions, sizeof(unsigned));
-  fcnMallocSize = (size_t*) calloc(totalNumFunctions, sizeof(size_t));
-  fcnDynTossCounts = (unsigned*) calloc(totalNumFunctions, sizeof(unsigned));
-  unfreedMallocs = (unsigned*) calloc(totalNumFunctions, sizeof(unsigned));
-  numFunctions = totalNumFunctions;
+extern "C" void heaptoss_fcn_run(HeapTossModule * module, size_t fcnId) {
+  HeapTossFcnStats & fcn = getFcnStats(module, fcnId);
+  __sync_fetch_and_add(&fcn.runCount, 1);
+  __sync_fetch_and_add(&fcn.unfreedMallocs, 1);
 }
@@ -0,0 +1,100 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+/* Runs a program built with HeapToss under every allocator backend, and reports the wall
+ * time, allocation throughput and peak RSS of each run as CSV.
+ *
+ * Usage: allocbench <program> [arguments...]
+ *
+ * The program's stdout is discarded. Its allocation count comes from the report that
+ * libHeapToss prints to stderr when HEAPTOSS_ALLOC_REPORT is set.
+ */
+
+static const char * backends[] = { "malloc", "pool", "bump" };
+
+/**
+ * Returns the value of the given counter in an allocation report, or 0 if it is not there.
+ */
+static unsigned long long getCounter(const std::string & report, const char * counter)
+{
+    std::string key = std::string(" ") + counter + "=";
+    size_t position = report.find(key);
+    if (position == std::string::npos) return 0;
+    return strtoull(report.c_str() + position + key.size(), NULL, 10);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <program> [arguments...]\n";
+        return 1;
+    }
+
+    std::cout << "Backend,Wall Time (s),Allocations,Allocations/s,Peak RSS (KB)\n";
+
+    for (unsigned b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+        int report[2];
+        if (pipe(report) != 0)
+        {
+            std::cerr << "pipe failed\n";
+            return 1;
+        }
+
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+
+        //Otherwise the child may write out what we have buffered.
+        std::cout.flush();
+
+        pid_t child = fork();
+        if (child == 0)
+        {
+            setenv("HEAPTOSS_ALLOCATOR", backends[b], 1);
+            setenv("HEAPTOSS_ALLOC_REPORT", "1", 1);
+            if (freopen("/dev/null", "w", stdout) == NULL) _exit(127);
+            dup2(report[1], 2);
+            close(report[0]);
+            close(report[1]);
+            execvp(argv[1], argv + 1);
+            _exit(127);
+        }
+        close(report[1]);
+
+        std::string output;
+        char buffer[4096];
+        ssize_t count;
+        while ((count = read(report[0], buffer, sizeof(buffer))) > 0)
+        {
+            output.append(buffer, count);
+        }
+        close(report[0]);
+
+        int status;
+        struct rusage usage;
+        wait4(child, &status, 0, &usage);
+        gettimeofday(&end, NULL);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            std::cerr << argv[1] << " failed under the " << backends[b] << " backend:\n" << output;
+            return 1;
+        }
+
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+        unsigned long long allocs = getCounter(output, "allocs");
+
+        //ru_maxrss is in kilobytes on Linux.
+        std::cout << backends[b] << "," << seconds << "," << allocs << ","
+            << (seconds > 0 ? allocs / seconds : 0) << "," << usage.ru_maxrss << "\n";
+    }
+
+    return 0;
+}
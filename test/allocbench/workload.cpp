@@ -0,0 +1,64 @@
+#include <iostream>
+#include <cstdlib>
+/* Allocation workload for allocbench.
+ *
+ * Usage: workload <iterations> <depth>
+ *
+ * Every function here passes the address of its locals to another function, so HeapToss
+ * tosses all of them. Each iteration walks a call chain of the given depth, which allocates
+ * and frees one frame per level in LIFO order, plus a few frames of different sizes along
+ * the way.
+ */
+
+int sink;
+
+__attribute__((noinline)) void touch(int * value, unsigned size)
+{
+    for (unsigned i = 0; i < size; i++) sink += value[i];
+}
+
+__attribute__((noinline)) int leafSmall(int n)
+{
+    int values[4] = { n, n + 1, n + 2, n + 3 };
+    touch(values, 4);
+    return values[3];
+}
+
+__attribute__((noinline)) int leafLarge(int n)
+{
+    int values[512];
+    for (unsigned i = 0; i < 512; i++) values[i] = n + i;
+    touch(values, 512);
+    return values[511];
+}
+
+__attribute__((noinline)) int chain(int depth, int n)
+{
+    int local = n;
+    touch(&local, 1);
+
+    if (depth == 0) return leafSmall(local) + leafLarge(local);
+    if (depth % 4 == 0) local += leafSmall(local);
+    return chain(depth - 1, local);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <iterations> <depth>\n";
+        return 1;
+    }
+
+    unsigned iterations = atoi(argv[1]);
+    int depth = atoi(argv[2]);
+
+    int result = 0;
+    for (unsigned i = 0; i < iterations; i++)
+    {
+        result += chain(depth, i);
+    }
+
+    std::cout << result << " " << sink << "\n";
+    return 0;
+}
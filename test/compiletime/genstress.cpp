@@ -0,0 +1,72 @@
+#include <iostream>
+#include <cstdlib>
+/* Generates an LLVM IR module that stresses HeapToss' escape analysis.
+ *
+ * Usage: genstress <functions> <slots per function> <GEP chain depth> <uses per GEP>
+ *
+ * Every function gets the given number of array stack slots. Each slot has a chain of GEPs
+ * of the given depth hanging off of it, and every GEP in the chain is loaded from and stored
+ * to the given number of times. Every third slot escapes through a call at the end of its
+ * chain, so the pass has both escaping and non-escaping slots to sort out.
+ */
+
+int main(int argc, char **argv)
+{
+    if (argc != 5)
+    {
+        std::cerr << "Usage: " << argv[0] << " <functions> <slots per function> <GEP chain depth> <uses per GEP>\n";
+        return 1;
+    }
+
+    unsigned numFunctions = atoi(argv[1]);
+    unsigned numSlots = atoi(argv[2]);
+    unsigned chainDepth = atoi(argv[3]);
+    unsigned numUses = atoi(argv[4]);
+    //Large enough that the chain never walks off of the end of the array.
+    unsigned arraySize = chainDepth + 1;
+
+    std::cout << "declare void @sink(i32*)\n\n";
+
+    for (unsigned f = 0; f < numFunctions; f++)
+    {
+        std::cout << "define i32 @f" << f << "(i32 %n) {\n";
+        std::cout << "entry:\n";
+
+        for (unsigned s = 0; s < numSlots; s++)
+        {
+            std::cout << "  %s" << s << " = alloca [" << arraySize << " x i32], align 4\n";
+        }
+
+        std::cout << "  br label %body\n\n";
+        std::cout << "body:\n";
+
+        for (unsigned s = 0; s < numSlots; s++)
+        {
+            //The head of the chain indexes into the array. The rest walk along it.
+            std::cout << "  %g" << s << "_0 = getelementptr inbounds [" << arraySize << " x i32]* %s" << s << ", i32 0, i32 0\n";
+            for (unsigned d = 1; d < chainDepth; d++)
+            {
+                std::cout << "  %g" << s << "_" << d << " = getelementptr inbounds i32* %g" << s << "_" << d - 1 << ", i32 " << (d % 2) << "\n";
+            }
+
+            for (unsigned d = 0; d < chainDepth; d++)
+            {
+                for (unsigned u = 0; u < numUses; u++)
+                {
+                    std::cout << "  store i32 %n, i32* %g" << s << "_" << d << ", align 4\n";
+                    std::cout << "  %l" << s << "_" << d << "_" << u << " = load i32* %g" << s << "_" << d << ", align 4\n";
+                }
+            }
+
+            if (s % 3 == 0)
+            {
+                std::cout << "  call void @sink(i32* %g" << s << "_" << chainDepth - 1 << ")\n";
+            }
+        }
+
+        std::cout << "  ret i32 %n\n";
+        std::cout << "}\n\n";
+    }
+
+    return 0;
+}
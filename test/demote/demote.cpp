@@ -0,0 +1,143 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+/* Built with -ht-demote-mallocs, the following mallocs should become stack slots:
+ *
+ * - scenario 0 (freed on every path)
+ * - scenario 1 (only freed on some paths)
+ * - scenario 2 (set with memset, and copied out with memcpy)
+ * - scenario 3 (copied into with memcpy)
+ *
+ * The following should NOT:
+ *
+ * - scenario 4 (passed to a function)
+ * - scenario 5 (stored in a global)
+ * - scenario 6 (larger than ht-demote-max-size)
+ * - scenario 7 (size not known)
+ * - scenario 8 (returned)
+ *
+ * "make check" counts the mallocs left after the pass.
+ */
+
+static const unsigned table[4] = { 3, 1, 4, 1 };
+unsigned * kept;
+
+__attribute__((noinline)) void function1(unsigned * values)
+{
+    values[0] *= 7;
+}
+
+//SCENARIO 0
+//Freed on every path. Should be demoted.
+__attribute__((noinline)) unsigned scenario0(unsigned x)
+{
+    unsigned * buffer = (unsigned *) malloc(4 * sizeof(unsigned));
+    for (unsigned i = 0; i < 4; i++) buffer[i] = x + i;
+    unsigned result = buffer[x & 3];
+    free(buffer);
+    return result;
+}
+
+//SCENARIO 1
+//Only freed on some paths. Should be demoted; the leak goes away.
+__attribute__((noinline)) unsigned scenario1(unsigned x)
+{
+    unsigned * buffer = (unsigned *) malloc(4 * sizeof(unsigned));
+    for (unsigned i = 0; i < 4; i++) buffer[i] = x * i;
+    unsigned result = buffer[(x + 1) & 3];
+    if (x & 1) free(buffer);
+    return result;
+}
+
+//SCENARIO 2
+//Set with memset and copied out with memcpy. Should be demoted.
+__attribute__((noinline)) unsigned scenario2(unsigned x)
+{
+    unsigned copy[4];
+    unsigned * buffer = (unsigned *) malloc(4 * sizeof(unsigned));
+    memset(buffer, (int) (x & 0xff), 4 * sizeof(unsigned));
+    memcpy(copy, buffer, 4 * sizeof(unsigned));
+    free(buffer);
+    return copy[0] + copy[3];
+}
+
+//SCENARIO 3
+//Copied into with memcpy. Should be demoted.
+__attribute__((noinline)) unsigned scenario3(unsigned x)
+{
+    unsigned * buffer = (unsigned *) malloc(4 * sizeof(unsigned));
+    memcpy(buffer, table, 4 * sizeof(unsigned));
+    unsigned result = buffer[x & 3];
+    free(buffer);
+    return result;
+}
+
+//SCENARIO 4
+//Passed to a function. Should NOT be demoted.
+__attribute__((noinline)) unsigned scenario4(unsigned x)
+{
+    unsigned * buffer = (unsigned *) malloc(4 * sizeof(unsigned));
+    buffer[0] = x;
+    function1(buffer);
+    unsigned result = buffer[0];
+    free(buffer);
+    return result;
+}
+
+//SCENARIO 5
+//Stored in a global. Should NOT be demoted.
+__attribute__((noinline)) unsigned scenario5(unsigned x)
+{
+    unsigned * buffer = (unsigned *) malloc(4 * sizeof(unsigned));
+    buffer[0] = x + 5;
+    kept = buffer;
+    return buffer[0];
+}
+
+//SCENARIO 6
+//Larger than ht-demote-max-size (256 bytes by default). Should NOT be demoted.
+__attribute__((noinline)) unsigned scenario6(unsigned x)
+{
+    unsigned * buffer = (unsigned *) malloc(1024 * sizeof(unsigned));
+    for (unsigned i = 0; i < 1024; i++) buffer[i] = x ^ i;
+    unsigned result = buffer[x & 1023];
+    free(buffer);
+    return result;
+}
+
+//SCENARIO 7
+//Sized at runtime. Should NOT be demoted.
+__attribute__((noinline)) unsigned scenario7(unsigned x)
+{
+    unsigned n = (x & 7) + 1;
+    unsigned * buffer = (unsigned *) malloc(n * sizeof(unsigned));
+    for (unsigned i = 0; i < n; i++) buffer[i] = x + i;
+    unsigned result = buffer[n - 1];
+    free(buffer);
+    return result;
+}
+
+//SCENARIO 8
+//Returned. Should NOT be demoted.
+__attribute__((noinline)) unsigned * scenario8(unsigned x)
+{
+    unsigned * buffer = (unsigned *) malloc(4 * sizeof(unsigned));
+    buffer[0] = x * 3;
+    return buffer;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned sum = 0;
+    for (unsigned x = 0; x < 16; x++)
+    {
+        sum += scenario0(x) + scenario1(x) + scenario2(x) + scenario3(x);
+        sum += scenario4(x) + scenario5(x) + scenario6(x) + scenario7(x);
+        unsigned * returned = scenario8(x);
+        sum += returned[0];
+        free(returned);
+        free(kept);
+    }
+    std::cout << sum << std::endl;
+    return 0;
+}
@@ -0,0 +1,33 @@
+/* Helpers for multitu.cpp, in their own translation unit. Built one file at a time, the
+ * pass cannot see these bodies, so every slot passed to them is tossed. Built with
+ * -ht-whole-program after llvm-link, it can.
+ */
+
+//Only reads through the pointer: never captures it.
+int sum(const int * values, int count)
+{
+	int total = 0;
+	for (int i = 0; i < count; i++) total += values[i];
+	return total;
+}
+
+//Only writes through the pointer, and passes it on to sum: never captures it.
+void scale(int * values, int count, int factor)
+{
+	for (int i = 0; i < count; i++) values[i] *= factor;
+	values[0] = sum(values, count);
+}
+
+int * kept;
+
+//Keeps the pointer in a global: captures it.
+void keep(int * value)
+{
+	kept = value;
+}
+
+//Returns the pointer: captures it.
+int * identity(int * value)
+{
+	return value;
+}
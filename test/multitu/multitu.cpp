@@ -0,0 +1,43 @@
+#include <iostream>
+/* With -ht-whole-program, only these variables should end up in the heap:
+ *
+ * - arg2
+ * - arg3
+ *
+ * Without it, arg0 and arg1 are tossed as well.
+ */
+
+int sum(const int * values, int count);
+void scale(int * values, int count, int factor);
+void keep(int * value);
+int * identity(int * value);
+
+extern int * kept;
+
+int main(int argc, char **argv)
+{
+	//SCENARIO 0
+	//Read by a function in another file. arg0 should NOT be put on the heap.
+	int arg0[4] = {1, 2, 3, 4};
+	std::cout << sum(arg0, 4) << std::endl;
+
+	//SCENARIO 1
+	//Written by a function in another file, which passes it on. arg1 should NOT be put on the heap.
+	int arg1[4] = {1, 2, 3, 4};
+	scale(arg1, 4, argc + 1);
+	std::cout << arg1[0] << std::endl;
+
+	//SCENARIO 2
+	//Kept in a global by a function in another file. arg2 should be put on the heap.
+	int arg2 = 5;
+	keep(&arg2);
+	std::cout << *kept << std::endl;
+	kept = 0;
+
+	//SCENARIO 3
+	//Returned by a function in another file. arg3 should be put on the heap.
+	int arg3 = 6;
+	std::cout << *identity(&arg3) << std::endl;
+
+	return 0;
+}
@@ -0,0 +1,307 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+/* Generates a random C++ program for differential testing of HeapToss.
+ *
+ * Usage: genprogram <seed> <functions> <statements per function>
+ *
+ * The program mixes escaping and non-escaping locals (scalars, arrays and structs),
+ * recursion, exceptions, memcpy/memset, variable-length arrays and small malloc'd buffers
+ * (freed on every path or only some, filled with memcpy/memset, or escaping). The functions
+ * also call helpers that can not throw or recurse, some static and some annotated with
+ * heaptoss_nonreentrant, which -ht-static-frames can give a static frame. Every value it computes
+ * goes into a checksum that it prints at the end, so a tossed build must print the same
+ * output as the untossed build. All arithmetic is unsigned and every index is in bounds,
+ * so the output does not depend on the compiler.
+ */
+
+//Small deterministic generator, so that a seed gives the same program everywhere.
+static unsigned long long state;
+
+static unsigned nextRandom(unsigned bound)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned) (state >> 33) % bound;
+}
+
+struct Local
+{
+    std::string name;
+    //0 for a scalar, otherwise the number of elements of an array.
+    unsigned elements;
+    bool isStruct;
+};
+
+static unsigned numFunctions;
+static unsigned numHelpers;
+
+/**
+ * Returns an expression that reads a random part of a local.
+ */
+static std::string read(const Local & local)
+{
+    std::stringstream expr;
+    if (local.isStruct) expr << local.name << ".b[" << nextRandom(4) << "]";
+    else if (local.elements > 0) expr << local.name << "[" << nextRandom(local.elements) << "]";
+    else expr << local.name;
+    return expr.str();
+}
+
+static std::string operand(const std::vector<Local> & locals)
+{
+    switch (nextRandom(3))
+    {
+        case 0: return "x";
+        case 1:
+        {
+            std::stringstream constant;
+            constant << nextRandom(1000) << "u";
+            return constant.str();
+        }
+        default: return read(locals[nextRandom(locals.size())]);
+    }
+}
+
+static std::string expression(const std::vector<Local> & locals)
+{
+    static const char * ops[] = { "+", "-", "*", "^", "|", "&" };
+    return operand(locals) + " " + ops[nextRandom(6)] + " " + operand(locals);
+}
+
+static void genFunction(unsigned f, unsigned numStatements)
+{
+    std::cout << "__attribute__((noinline)) unsigned f" << f << "(unsigned x, unsigned depth)\n{\n";
+
+    std::vector<Local> locals;
+    unsigned numLocals = 2 + nextRandom(5);
+    for (unsigned l = 0; l < numLocals; l++)
+    {
+        Local local;
+        std::stringstream name;
+        name << "l" << l;
+        local.name = name.str();
+        local.isStruct = nextRandom(4) == 0;
+        local.elements = local.isStruct || nextRandom(3) != 0 ? 0 : 1 + nextRandom(16);
+
+        if (local.isStruct) std::cout << "    Record " << local.name << ";\n"
+            << "    memset(&" << local.name << ", (int) (x & 0xff), sizeof(Record));\n";
+        else if (local.elements > 0) std::cout << "    unsigned " << local.name << "[" << local.elements << "];\n"
+            << "    for (unsigned i = 0; i < " << local.elements << "; i++) " << local.name << "[i] = x + i;\n";
+        else std::cout << "    unsigned " << local.name << " = x + " << l << "u;\n";
+
+        locals.push_back(local);
+    }
+
+    for (unsigned s = 0; s < numStatements; s++)
+    {
+        const Local & target = locals[nextRandom(locals.size())];
+        switch (nextRandom(11))
+        {
+            //Plain arithmetic on locals. Keeps non-escaping locals around.
+            case 0:
+            case 1:
+                std::cout << "    " << read(target) << " = " << expression(locals) << ";\n";
+                break;
+            //Lets a local escape.
+            //Escapes the whole local, or a single field or element so the rest can be split off.
+            case 2:
+            {
+                unsigned part = nextRandom(3);
+                if (target.isStruct && part == 0) std::cout << "    sinkRecord(&" << target.name << ");\n";
+                else if (target.isStruct && part == 1) std::cout << "    sinkByte(&" << target.name << ".a);\n";
+                else if (target.isStruct)
+                {
+                    unsigned k = nextRandom(4);
+                    std::cout << "    sink(&" << target.name << ".b[" << k << "], " << 4 - k << ");\n";
+                }
+                else if (target.elements > 0 && part != 0)
+                {
+                    unsigned k = nextRandom(target.elements);
+                    std::cout << "    sink(&" << target.name << "[" << k << "], " << target.elements - k << ");\n";
+                }
+                else if (target.elements > 0) std::cout << "    sink(" << target.name << ", " << target.elements << ");\n";
+                else std::cout << "    sink(&" << target.name << ", 1);\n";
+                break;
+            }
+            //A loop that reads and writes a local.
+            case 3:
+                std::cout << "    for (unsigned i = 0; i < (x & 15); i++) " << read(target) << " += i * " << operand(locals) << ";\n";
+                break;
+            //memcpy between two locals of the same kind, or memset.
+            case 4:
+            {
+                const Local & source = locals[nextRandom(locals.size())];
+                if (source.isStruct && target.isStruct && source.name != target.name)
+                    std::cout << "    memcpy(&" << target.name << ", &" << source.name << ", sizeof(Record));\n";
+                else if (target.elements > 0)
+                    std::cout << "    memset(" << target.name << ", (int) (" << operand(locals) << " & 0xff), sizeof(" << target.name << "));\n";
+                else
+                    std::cout << "    " << read(target) << " ^= " << operand(locals) << ";\n";
+                break;
+            }
+            //A variable-length array.
+            case 5:
+                std::cout << "    {\n"
+                    << "        unsigned n = (" << operand(locals) << " & 7) + 1;\n"
+                    << "        unsigned vla[n];\n"
+                    << "        for (unsigned i = 0; i < n; i++) vla[i] = " << operand(locals) << " + i;\n"
+                    << "        sink(vla, n);\n"
+                    << "        " << read(target) << " += vla[n - 1];\n"
+                    << "    }\n";
+                break;
+            //A call, which may recurse.
+            case 6:
+                std::cout << "    if (depth > 0) " << read(target) << " += f" << nextRandom(numFunctions) << "(" << operand(locals) << ", depth - 1);\n";
+                break;
+            //A call that may throw, and catches it.
+            case 7:
+                std::cout << "    try {\n"
+                    << "        if (depth > 0) " << read(target) << " += f" << nextRandom(numFunctions) << "(" << operand(locals) << ", depth - 1);\n"
+                    << "    }\n"
+                    << "    catch (const Error & e) {\n"
+                    << "        mix(e.code);\n"
+                    << "        " << read(target) << " += e.code;\n"
+                    << "    }\n";
+                break;
+            //May throw, leaving the locals behind.
+            case 8:
+                std::cout << "    if (((" << operand(locals) << ") & 31) == " << nextRandom(32) << ") throw Error(" << read(target) << ");\n";
+                break;
+            //A small malloc'd buffer of constant size, which -ht-demote-mallocs may turn into
+            //a stack slot.
+            case 9:
+            {
+                unsigned n = 1 + nextRandom(16);
+                std::cout << "    {\n"
+                    << "        unsigned * m = (unsigned *) malloc(" << n << " * sizeof(unsigned));\n"
+                    << "        for (unsigned i = 0; i < " << n << "; i++) m[i] = " << operand(locals) << " + i;\n";
+                switch (nextRandom(4))
+                {
+                    //Freed on every path.
+                    case 0:
+                        std::cout << "        " << read(target) << " += m[" << nextRandom(n) << "];\n"
+                            << "        free(m);\n";
+                        break;
+                    //Only freed on some paths.
+                    case 1:
+                        std::cout << "        " << read(target) << " += m[" << nextRandom(n) << "];\n"
+                            << "        if (((" << operand(locals) << ") & 1) == 0) free(m);\n"
+                            << "        else mix(m[0]);\n";
+                        break;
+                    //Set and copied as a whole.
+                    case 2:
+                        std::cout << "        memset(m, (int) (" << operand(locals) << " & 0xff), " << n << " * sizeof(unsigned));\n";
+                        if (target.elements > 0)
+                            std::cout << "        memcpy(" << target.name << ", m, " << std::min(n, target.elements) << " * sizeof(unsigned));\n";
+                        else
+                            std::cout << "        memcpy(m, &x, sizeof(unsigned));\n"
+                                << "        " << read(target) << " += m[0];\n";
+                        std::cout << "        free(m);\n";
+                        break;
+                    //Its address escapes.
+                    default:
+                        std::cout << "        sink(m, " << n << ");\n"
+                            << "        " << read(target) << " += m[" << nextRandom(n) << "];\n"
+                            << "        free(m);\n";
+                        break;
+                }
+                std::cout << "    }\n";
+                break;
+            }
+            //A helper with an escaping local, which never recurses or throws.
+            case 10:
+                std::cout << "    " << read(target) << " += h" << nextRandom(numHelpers) << "(" << operand(locals) << ");\n";
+                break;
+        }
+    }
+
+    std::cout << "    unsigned result = x;\n";
+    for (unsigned l = 0; l < locals.size(); l++)
+    {
+        if (locals[l].isStruct) std::cout << "    " << locals[l].name << ".c += " << locals[l].name << ".a;\n"
+            << "    mix(" << locals[l].name << ".c);\n";
+        std::cout << "    mix(" << read(locals[l]) << ");\n";
+        std::cout << "    result += " << read(locals[l]) << ";\n";
+    }
+    std::cout << "    return result;\n}\n\n";
+}
+
+/**
+ * Even helpers are static, so only this module can call them. Odd ones are annotated as
+ * non-reentrant instead.
+ */
+static void genHelper(unsigned h)
+{
+    unsigned n = 1 + nextRandom(8);
+    if (h % 2 == 0) std::cout << "static __attribute__((noinline)) unsigned h" << h << "(unsigned x) throw()\n{\n";
+    else std::cout << "__attribute__((noinline, annotate(\"heaptoss_nonreentrant\"))) unsigned h" << h << "(unsigned x) throw()\n{\n";
+    std::cout << "    unsigned values[" << n << "];\n"
+        << "    for (unsigned i = 0; i < " << n << "; i++) values[i] = x * i + " << nextRandom(1000) << "u;\n"
+        << "    sink(values, " << n << ");\n"
+        << "    return values[0] + values[" << n - 1 << "];\n}\n\n";
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        std::cerr << "Usage: " << argv[0] << " <seed> <functions> <statements per function>\n";
+        return 1;
+    }
+
+    state = strtoull(argv[1], NULL, 10);
+    numFunctions = atoi(argv[2]);
+    unsigned numStatements = atoi(argv[3]);
+    if (numFunctions == 0)
+    {
+        std::cerr << "Need at least one function.\n";
+        return 1;
+    }
+
+    std::cout << "#include <cstdio>\n#include <cstdlib>\n#include <cstring>\n\n"
+        << "struct Error { unsigned code; Error(unsigned code) : code(code) {} };\n"
+        << "struct Record { unsigned char a; unsigned b[4]; unsigned long long c; };\n\n"
+        << "static unsigned long long checksum = 0;\n"
+        << "static void mix(unsigned long long value) { checksum = checksum * 1099511628211ULL + value; }\n\n"
+        << "__attribute__((noinline)) void sink(unsigned * values, unsigned n) throw()\n{\n"
+        << "    for (unsigned i = 0; i < n; i++) mix(values[i]);\n"
+        << "    values[0] += 1;\n}\n\n"
+        << "__attribute__((noinline)) void sinkByte(unsigned char * value) throw()\n{\n"
+        << "    mix(*value);\n    *value += 1;\n}\n\n"
+        << "__attribute__((noinline)) void sinkRecord(Record * record) throw()\n{\n"
+        << "    mix(record->a);\n    sink(record->b, 4);\n    record->c += record->b[0];\n}\n\n";
+
+    numHelpers = numFunctions / 2 + 1;
+    for (unsigned h = 0; h < numHelpers; h++)
+    {
+        genHelper(h);
+    }
+
+    for (unsigned f = 0; f < numFunctions; f++)
+    {
+        std::cout << "unsigned f" << f << "(unsigned x, unsigned depth);\n";
+    }
+    std::cout << "\n";
+
+    for (unsigned f = 0; f < numFunctions; f++)
+    {
+        genFunction(f, numStatements);
+    }
+
+    std::cout << "int main()\n{\n"
+        << "    for (unsigned x = 0; x < 64; x++) {\n"
+        << "        try {\n"
+        << "            mix(f0(x, 4));\n"
+        << "        }\n"
+        << "        catch (const Error & e) {\n"
+        << "            mix(e.code + 1);\n"
+        << "        }\n"
+        << "    }\n"
+        << "    printf(\"%llu\\n\", checksum);\n"
+        << "    return 0;\n}\n";
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+#!/bin/sh
+# Differential testing of HeapToss on random programs.
+#
+# Usage: runstress.sh <first seed> <last seed> [functions] [statements per function]
+#
+# Needs LLVM_BIN (where clang++ and opt are) and PROJ_LIB (where HeapTossPass and
+# libHeapToss are). SHLIBEXT defaults to .so. For every seed, the program from genprogram is built untossed and under
+# every toss mode, and each tossed build must print what the untossed build prints. The run
+# time and allocation count of every build go to stress_results.csv. Failing programs are
+# kept as stress_<seed>.cpp, and so are programs whose untossed build fails.
+
+FIRST=$1
+LAST=$2
+FUNCTIONS=${3:-8}
+STATEMENTS=${4:-12}
+
+if [ -z "$FIRST" ] || [ -z "$LAST" ] || [ -z "$LLVM_BIN" ] || [ -z "$PROJ_LIB" ]; then
+  echo "Usage: LLVM_BIN=... PROJ_LIB=... $0 <first seed> <last seed> [functions] [statements per function]" >&2
+  exit 1
+fi
+
+# Every toss mode to check, one per line. Leading NAME=value words are set in the
+# environment of the tossed program instead of being passed to opt.
+MODES="-ht-toss-individually
+-ht-toss-all
+-ht-toss-all -ht-toss-individually
+-ht-toss-all -ht-coalesce-frames
+-ht-toss-all -ht-shadow-slots
+-ht-toss-all -ht-version-memintrinsics=false
+-ht-toss-all -ht-allocator-abi=false
+-ht-toss-all -ht-annotate-frames=false
+-ht-split-aggregates
+-ht-static-frames -ht-single-threaded
+-ht-static-frames -ht-check-reentrancy
+-ht-static-frames -ht-single-threaded -ht-check-reentrancy
+HEAPTOSS_TOSS=none -ht-multiversion
+-ht-cost-model
+-ht-demote-mallocs"
+
+# Allocator backends to run every tossed build under.
+BACKENDS="malloc pool bump"
+
+export LD_LIBRARY_PATH=$PROJ_LIB
+failures=0
+
+# Runs a build with the variables in runenv, and sets output, seconds and allocs.
+run() {
+  start=`date +%s.%N`
+  output=`env $runenv HEAPTOSS_ALLOCATOR=$2 HEAPTOSS_ALLOC_REPORT=1 ./$1 < /dev/null 2> stress.err`
+  status=$?
+  end=`date +%s.%N`
+  seconds=`echo "$start $end" | awk '{ print $2 - $1 }'`
+  allocs=`sed -n 's/.* allocs=\([0-9]*\).*/\1/p' stress.err`
+  [ -z "$allocs" ] && allocs=0
+  return $status
+}
+
+echo "Seed,Mode,Backend,Result,Time (s),Allocations" > stress_results.csv
+
+seed=$FIRST
+while [ $seed -le $LAST ]; do
+  ./genprogram $seed $FUNCTIONS $STATEMENTS > stress_$seed.cpp
+  $LLVM_BIN/clang++ -O1 -emit-llvm -c -o stress.bc stress_$seed.cpp || exit 1
+  $LLVM_BIN/clang++ -O1 -o stress_base stress.bc || exit 1
+
+  #A program that fails untossed has nothing to compare against, so its seed fails as a whole.
+  if ! run stress_base malloc; then
+    echo "$seed,untossed,malloc,exit status $status,$seconds,$allocs" >> stress_results.csv
+    echo "seed $seed: the untossed build exited with status $status" >&2
+    failures=`expr $failures + 1`
+    seed=`expr $seed + 1`
+    continue
+  fi
+  expected=$output
+  echo "$seed,untossed,malloc,ok,$seconds,$allocs" >> stress_results.csv
+  failed=0
+
+  echo "$MODES" | while read mode; do
+    runenv=
+    flags=
+    for word in $mode; do
+      case $word in
+        [A-Z]*=*) runenv="$runenv $word" ;;
+        *) flags="$flags $word" ;;
+      esac
+    done
+
+    if ! $LLVM_BIN/opt -load $PROJ_LIB/HeapTossPass${SHLIBEXT:-.so} -heaptoss $flags -o stress.ht.bc stress.bc; then
+      echo "$seed,$mode,,compile error,," >> stress_results.csv
+      echo "seed $seed: HeapToss failed with $mode" >&2
+      exit 1
+    fi
+    $LLVM_BIN/clang++ -O1 -o stress_tossed stress.ht.bc -L$PROJ_LIB -lheaptoss -lpthread || exit 1
+
+    for backend in $BACKENDS; do
+      if run stress_tossed $backend && [ "$output" = "$expected" ]; then
+        result=ok
+      else
+        result=MISMATCH
+        echo "seed $seed: $mode under $backend printed '$output', expected '$expected'" >&2
+        failed=1
+      fi
+      echo "$seed,$mode,$backend,$result,$seconds,$allocs" >> stress_results.csv
+    done
+    [ $failed -eq 0 ] || exit 1
+  done
+  if [ $? -ne 0 ]; then
+    failures=`expr $failures + 1`
+  else
+    rm -f stress_$seed.cpp
+  fi
+
+  seed=`expr $seed + 1`
+done
+
+rm -f stress.bc stress.ht.bc stress.err stress_base stress_tossed
+echo "$failures failing seeds. Results are in stress_results.csv."
+[ $failures -eq 0 ]
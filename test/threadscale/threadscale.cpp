@@ -0,0 +1,130 @@
+#include <iostream>
+#include <cstdlib>
+#include <pthread.h>
+#include <sys/time.h>
+/* Multi-threaded scaling benchmark for tossed code.
+ *
+ * Usage: threadscale <max threads> <calls per thread> <depth>
+ *
+ * Runs the same tossed call chains on 1, 2, 4, ... up to max threads at once, with a fixed
+ * number of calls per thread. For each thread count it reports the throughput, the speedup
+ * over one thread, and the allocator counters of the run: allocations, lock contentions and
+ * cross-thread frees. The backend comes from HEAPTOSS_ALLOCATOR as usual, so run it once per
+ * backend to compare them.
+ */
+
+//Must match HeapTossAllocStats in HeapTossAllocator.cpp.
+struct HeapTossAllocStats {
+    unsigned long long allocs;
+    unsigned long long frees;
+    unsigned long long largeAllocs;
+    unsigned long long crossThreadFrees;
+    unsigned long long lockContentions;
+};
+
+extern "C" const char * heaptoss_alloc_get_stats(HeapTossAllocStats * stats);
+
+//Per thread, and on its own cache line, so that the threads do not share anything.
+struct Sink {
+    unsigned value;
+    char padding[64 - sizeof(unsigned)];
+};
+
+struct Worker {
+    pthread_t thread;
+    Sink * sink;
+    unsigned calls;
+    int depth;
+};
+
+__attribute__((noinline)) void touch(unsigned * value, unsigned size, Sink * sink)
+{
+    for (unsigned i = 0; i < size; i++) sink->value += value[i];
+}
+
+__attribute__((noinline)) unsigned leaf(unsigned n, Sink * sink)
+{
+    unsigned values[16];
+    for (unsigned i = 0; i < 16; i++) values[i] = n + i;
+    touch(values, 16, sink);
+    return values[15];
+}
+
+__attribute__((noinline)) unsigned chain(int depth, unsigned n, Sink * sink)
+{
+    unsigned local = n;
+    touch(&local, 1, sink);
+
+    if (depth == 0) return leaf(local, sink);
+    return chain(depth - 1, local + 1, sink);
+}
+
+void * work(void * arg)
+{
+    Worker * worker = (Worker *) arg;
+    for (unsigned c = 0; c < worker->calls; c++)
+    {
+        chain(worker->depth, c, worker->sink);
+    }
+    return NULL;
+}
+
+static double now()
+{
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    return time.tv_sec + time.tv_usec / 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        std::cerr << "Usage: " << argv[0] << " <max threads> <calls per thread> <depth>\n";
+        return 1;
+    }
+
+    unsigned maxThreads = atoi(argv[1]);
+    unsigned calls = atoi(argv[2]);
+    int depth = atoi(argv[3]);
+
+    Worker * workers = new Worker[maxThreads];
+    Sink * sinks = new Sink[maxThreads];
+
+    HeapTossAllocStats before;
+    const char * backend = heaptoss_alloc_get_stats(&before);
+
+    std::cout << "Backend,Threads,Calls/s,Speedup,Allocations,Lock Contentions,Cross-thread Frees\n";
+    double singleThreadRate = 0;
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        double start = now();
+        for (unsigned t = 0; t < threads; t++)
+        {
+            workers[t].sink = &sinks[t];
+            workers[t].calls = calls;
+            workers[t].depth = depth;
+            pthread_create(&workers[t].thread, NULL, work, &workers[t]);
+        }
+        for (unsigned t = 0; t < threads; t++)
+        {
+            pthread_join(workers[t].thread, NULL);
+        }
+        double seconds = now() - start;
+
+        HeapTossAllocStats after;
+        heaptoss_alloc_get_stats(&after);
+
+        double rate = threads * (double) calls / seconds;
+        if (threads == 1) singleThreadRate = rate;
+
+        std::cout << backend << "," << threads << "," << rate << "," << rate / singleThreadRate << ","
+            << after.allocs - before.allocs << "," << after.lockContentions - before.lockContentions << ","
+            << after.crossThreadFrees - before.crossThreadFrees << "\n";
+        before = after;
+    }
+
+    delete [] workers;
+    delete [] sinks;
+    return 0;
+}